@@ -133,9 +133,9 @@ def generate_functions(name, flags, snippet, enc, functions, l2):
         # Be sure to duplicate %s
         snippet = ['asm volatile("'+ ";".join([re.sub(r'([^%])%([^%0-9])', r'\1%%\2', s) for s in snippet])+'" : "+d"(tmp_src), "+c"(tmp_dst) : : "eax")']
     if "FPU" in flags:
-        if "FPUNORESTORE" not in flags:  snippet = ['fxrstor (%%\" EXPAND(REG(ax)) \")'] + snippet
         snippet = ['if (cache->_cpu->cr0 & 0xc) EXCEPTION(cache, 0x7, 0)',
-                   'asm volatile("' + ';'.join(snippet)+'; fxsave (%%\" EXPAND(REG(ax)) \");" : "+d"(tmp_src), "+c"(tmp_dst) : "a"(cache->_fpustate))']
+                   'cache->fpu_load()',
+                   'asm volatile("' + ';'.join(snippet)+'" : "+d"(tmp_src), "+c"(tmp_dst))']
     if "CPL0" in flags:
         snippet = ["if (cache->cpl0_test()) return"] + snippet
     # parameter handling
@@ -159,12 +159,12 @@ def generate_functions(name, flags, snippet, enc, functions, l2):
     l2.extend(filter(lambda x: x, map(lambda x: x[0] in flags and x[1] or "", additions)))
 
     # flag handling
-    f2 = ["LOADFLAGS", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD"]
+    f2 = ["LOADFLAGS", "LOADCF", "KEEPCF", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD"]
     if "SKIPMODRM" in flags:                    f2.remove("MODRM")
     if "IMM1" in flags and "BITS" in flags:     f2.remove("BITS")
     if name in ["cltd"]:                        f2.remove("DIRECTION")
     f = map(lambda x: "IC_%s"%x, filter(lambda x: x in f2, flags))
-    if f: l2.append("entry->flags = %s"%"|".join(f))
+    if f: l2.extend(["entry->flags = %s"%"|".join(f), "entry->run = execute_entry<%s>"%"|".join(f)])
 
     # operand size loop
     s = ""
@@ -310,13 +310,13 @@ opcodes += [(x, ["ASM", "EAX", "NO_OS", x in ["aaa", "aas"] and "LOADFLAGS", "SA
 	     ["#ifdef __x86_64__\n\tLogging::panic(\"Unable to execute '" + x + "'\\n\");\n#else\n\tasm volatile(\"mov (%%\" EXPAND(REG(cx)) \"), %%eax;" + x + ";mov %%eax, (%%\" EXPAND(REG(cx)) \")\" : \"+d\"(tmp_src), \"+c\"(tmp_dst) : : \"eax\");\n#endif\n"])
 	    for x in ["aaa", "aas", "daa", "das"]]
 opcodes += [(x, ["ASM", x in ["cmp", "test"] and "READONLY",
-	   		x in ["adc", "sbb"] and "LOADFLAGS",
+	   		x in ["adc", "sbb"] and "LOADCF",
 			x not in ["mov"] and "SAVEFLAGS",
 			x not in ["mov", "cmp",  "test"] and "RMW",
 			],
 	     ["mov[bwl] (%\" EXPAND(REG(dx)) \"), [EAX]", "[lock] %s[bwl] [EAX],(%%\" EXPAND(REG(cx)) \")"%x])
 	    for x in ["mov", "add", "adc", "sub", "sbb", "and", "or", "xor", "cmp", "test"]]
-opcodes += [(x, ["ASM", x not in ["not"] and "SAVEFLAGS", x in ["dec", "inc"] and "LOADFLAGS", "RMW"],
+opcodes += [(x, ["ASM", x not in ["not"] and "SAVEFLAGS", x in ["dec", "inc"] and "KEEPCF", "RMW"],
 	     ["[lock] " + x + "[bwl] (%\" EXPAND(REG(cx)) \")"])
 	    for x in ["inc", "dec", "neg", "not"]]
 opcodes += [(x, ["ASM", "CONST1", x in ["rcr", "rcl"] and "LOADFLAGS", "SAVEFLAGS", "RMW"],
@@ -325,13 +325,10 @@ opcodes += [(x, ["ASM", "SAVEFLAGS", "DIRECTION"], ["%s[bwl] (%%\" EXPAND(REG(dx
 ccflags = map(lambda x: compile_and_disassemble(".byte %#x, 0x00"%x, file, fdict)[2].split()[0][1:], range(0x70, 0x80))
 for i in range(len(ccflags)):
     ccflag = ccflags[i]
-    opcodes += [("set" +ccflag, ["BYTE",   "ASM", "LOADFLAGS"], ["set%s (%%\" EXPAND(REG(cx)) \")"%ccflag])]
-    opcodes += [("cmov"+ccflag, ["NO_OS",  "ASM", "LOADFLAGS",  "OS2"], ["j%s 1f"%(ccflags[i ^ 1]), "mov (%\" EXPAND(REG(dx)) \"), %eax", "mov %eax, (%\" EXPAND(REG(cx)) \")", "1:"])]
-    # use call %P0 instead of call %c0; seems to be a gcc-bug that occurs with -mcmodel=large
-    # (see http://gcc.gnu.org/bugzilla/show_bug.cgi?id=46477)
-    opcodes += [("j"+ccflag,    ["JMP",   "ASM", "LOADFLAGS", "DIRECTION"],
-		 ['__attribute__((regparm(3))) int (*foo)(InstructionCache *, void *) = helper_JMP_static<[os]>',
-		  'asm volatile ("j%s 1f;call %%P0; 1:" : : "i"(foo))'%(ccflags[i ^ 1])])]
+    # the condition is evaluated from the guest flags, so no popf is needed
+    opcodes += [("set" +ccflag, ["BYTE"], ["*reinterpret_cast<unsigned char *>(tmp_dst) = cache->helper_condition(%d)"%i])]
+    opcodes += [("cmov"+ccflag, ["NO_OS", "OS2"], ["if (cache->helper_condition(%d)) move<2>(tmp_dst, tmp_src)"%i])]
+    opcodes += [("j"+ccflag,    ["JMP", "DIRECTION"], ["if (cache->helper_condition(%d)) cache->helper_JMP<[os]>(tmp_src)"%i])]
 opcodes += [(x, [x[-1] == "b" and "BYTE", "HAS_OS"], [
             "unsigned dummy",
 	    "tmp_dst = cache->get_reg32((cache->_entry->data[cache->_entry->offset_opcode] >> 3) & 0x7)",
@@ -421,7 +418,7 @@ for x in segment_list:
     opcodes += [("push %"+x, [], ["cache->helper_PUSH<[os]>(&cache->_cpu->%s.sel)"%x]),
 		("pop %"+x, [], ["unsigned sel", "cache->helper_POP<[os]>(&sel) || cache->set_segment(&cache->_cpu->%s, sel)"%x, x == "ss" and "cache->_cpu->intr_state |= 2" or ""]),
 		("l"+x, ["SKIPMODRM", "MODRM", "MEMONLY"], ["cache->helper_loadsegment<[os]>(&cache->_cpu->%s)"%x])]
-opcodes += [(x, ["FPU", "FPUNORESTORE", "NO_OS"], [x]) for x in ["fninit"]]
+opcodes += [(x, ["FPU", "NO_OS"], [x]) for x in ["fninit"]]
 opcodes += [(x, ["FPU", "NO_OS"], [x+" (%%\" EXPAND(REG(cx)) \")"]) for x in ["fnstsw", "fnstcw", "ficom", "ficomp"]]
 opcodes += [(x, ["FPU", "NO_OS", "EAX"], ["fnstsw (%%\" EXPAND(REG(cx)) \")"]) for x in ["fnstsw %ax"]]
 opcodes += [(".byte 0xdb, 0xe4 ", ["NO_OS", "COMPLETE"], ["/* fnsetpm, on 287 only, noop afterwards */"])]
@@ -429,9 +426,9 @@ opcodes += [(x, [x not in ["bt"] and "RMW" or "READONLY", "SAVEFLAGS", "BITS", "
 										       "and  $(8<<[os])-1, %eax",
 											"[lock] "+x+" [EAX],(%\" EXPAND(REG(cx)) \")"]) for x in ["bt", "btc", "bts", "btr"]]
 opcodes += [("cmpxchg", ["RMW"], ['char res; asm volatile("mov (%2), %2; [lock] cmpxchg [EDX], (%3); setz %1" : "+a"(cache->_cpu->eax), "=d"(res) : "d"(tmp_src), "c"(tmp_dst))',
-				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= EFL_ZF"])]
+				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= ~EFL_ZF"])]
 opcodes += [("cmpxchg8b", ["RMW", "NO_OS", "QWORD"], ['char res; asm volatile("[lock] cmpxchg8b (%3); setz %2" : "+a"(cache->_cpu->eax), "+d"(cache->_cpu->edx), "=c"(res) : "D"(tmp_dst), "b"(cache->_cpu->ebx), "c"(cache->_cpu->ecx))',
-				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= EFL_ZF"])]
+				  "if (res) cache->_cpu->efl |= EFL_ZF; else cache->_cpu->efl &= ~EFL_ZF"])]
 opcodes += [("xadd", ["RMW", "ASM", "SAVEFLAGS"], ['mov (%\" EXPAND(REG(dx)) \"), [EAX]', '[lock] xadd [EAX], (%\" EXPAND(REG(cx)) \")', 'mov [EAX], (%\" EXPAND(REG(dx)) \")'])]
 
 # unimplemented instructions
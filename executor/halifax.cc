@@ -35,15 +35,32 @@ public:
     return true;
   }
 
-  Halifax(VCpu *vcpu) : InstructionCache(vcpu) {
+  Halifax(VCpu *vcpu, DBus<MessageHostOp> &hostop, unsigned max_block, unsigned set_bits, unsigned assoz, SharedInstructionCache *shared)
+    : InstructionCache(vcpu, hostop, max_block, set_bits, assoz, shared) {
     vcpu->executor.add(this,  receive_static);
   }
   void *operator new(size_t size)  { return new /*(__alignof__(Halifax))*/ char[size]; }
 };
 
 PARAM_HANDLER(halifax,
-	      "halifax - create a halifax that emulatates instructions.")
+	      "halifax:maxblock=32,sets=1024,assoz=4,shared=0 - create a halifax that emulatates instructions.",
+	      "The maxblock parameter limits the number of instructions executed in a single step, which trades interrupt latency against throughput.",
+	      "A step ends earlier at I/O, HLT, a new event or the timer deadline of the frontend.",
+	      "The instruction cache has sets*assoz entries, the number of sets is rounded down to a power of two.",
+	      "With shared, all halifaxes share a store of that many decoded instructions, which saves decoding on SMP guests.",
+	      "Example: 'halifax:1' steps through every instruction.")
 {
   if (!mb.last_vcpu) Logging::panic("no VCPU for this Halifax");
-  new Halifax(mb.last_vcpu);
+  unsigned long sets  = (argv[1] == ~0UL || !argv[1]) ? 1024 : argv[1];
+  unsigned long assoz = (argv[2] == ~0UL || !argv[2]) ? 4 : argv[2];
+  if (sets > (1 << 20) || assoz > 64) Logging::panic("halifax cache of %lux%lu entries is too large", sets, assoz);
+
+  // the first halifax that asks for it creates the shared store
+  static SharedInstructionCache *shared;
+  if (!shared && argv[3] != ~0UL && argv[3]) {
+    if (argv[3] > (1 << 20)) Logging::panic("shared halifax cache of %lu entries is too large", argv[3]);
+    shared = new SharedInstructionCache(argv[3]);
+  }
+  new Halifax(mb.last_vcpu, mb.bus_hostop, (argv[0] == ~0UL || !argv[0]) ? 32 : argv[0], Cpu::bsr(sets), assoz,
+	      (argv[3] != ~0UL && argv[3]) ? shared : nullptr);
 }
@@ -103,12 +103,124 @@ struct InstructionCacheEntry
   unsigned operand_size;
   unsigned address_size;
   unsigned modrminfo;
+  // the effective address of the modrm operand as selected by get_modrm()
+  unsigned (*ea)(InstructionCacheEntry *entry, mword *gpr);
+  unsigned ea_disp;
+  unsigned char ea_base, ea_index, ea_scale;
   unsigned cs_ar;
   unsigned prefixes;
   void __attribute__((regparm(3))) (*execute)(InstructionCache *instr, void *tmp_src, void *tmp_dst);
+  // the operand handling specialized for the flags
+  int (*run)(InstructionCache *instr);
   void     *src;
   void     *dst;
   unsigned immediate;
+  // index+1 of the entry that followed this one the last time, 0 if unknown
+  unsigned chain;
+  // the physical address of the code, ~0 if it crosses a page
+  uintptr_t phys;
+  // the generation of the code page when the bytes were last checked
+  unsigned generation;
+  // the time of the last use for the replacement
+  unsigned used;
+
+  template<bool base, bool index>
+  static unsigned effective_address(InstructionCacheEntry *entry, mword *gpr)
+  {
+    unsigned virt = entry->ea_disp;
+    if (base)  virt += gpr[entry->ea_base];
+    if (index) virt += gpr[entry->ea_index] << entry->ea_scale;
+    return virt;
+  }
+};
+
+
+/**
+ * Decoded instructions shared by the instruction caches of all VCPUs
+ * of a guest.  The entries are keyed by the physical address of the
+ * code, the CS attributes and the generation of the code page, so a
+ * write to the code makes them unreachable.  Instructions crossing a
+ * page are not shared.
+ *
+ * Lookups take no lock.  Every slot has a sequence number that is odd
+ * while the slot is written.  A reader that sees it change discards
+ * its copy, and a writer that finds the slot busy does not publish.
+ */
+class SharedInstructionCache
+{
+  struct Slot
+  {
+    volatile unsigned seq;
+    unsigned cs_ar;
+    unsigned generation;
+    uintptr_t phys;
+    // the CpuState and the entry of the publisher for the relocation
+    const void *cpu;
+    const void *orig;
+    InstructionCacheEntry entry;
+  };
+  unsigned _size;
+  Slot    *_slots;
+
+  Slot &slot(uintptr_t phys, unsigned cs_ar) { return _slots[(phys ^ (phys >> 12) ^ cs_ar) % _size]; }
+
+  /**
+   * Operands can point into the CpuState or into the entry itself.
+   */
+  static void relocate(void *&ptr, const void *from, void *to, size_t size)
+  {
+    uintptr_t offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(from);
+    if (offset < size) ptr = reinterpret_cast<char *>(to) + offset;
+  }
+
+public:
+  /**
+   * Copy a shared entry of at most max_len bytes into the entry of
+   * the given CPU.
+   */
+  bool lookup(uintptr_t phys, unsigned cs_ar, unsigned generation, unsigned max_len, CpuState *cpu, InstructionCacheEntry *entry)
+  {
+    Slot &s = slot(phys, cs_ar);
+    unsigned seq = s.seq;
+    if (!seq || seq & 1) return false;
+    asm volatile ("" : : : "memory");
+    if (s.phys != phys || s.cs_ar != cs_ar || s.generation != generation || s.entry.inst_len > max_len) return false;
+    InstructionCacheEntry tmp = s.entry;
+    const void *from_cpu   = s.cpu;
+    const void *from_entry = s.orig;
+    asm volatile ("" : : : "memory");
+    if (s.seq != seq) return false;
+
+    relocate(tmp.src, from_cpu, cpu, sizeof(*cpu));
+    relocate(tmp.dst, from_cpu, cpu, sizeof(*cpu));
+    relocate(tmp.src, from_entry, entry, sizeof(*entry));
+    relocate(tmp.dst, from_entry, entry, sizeof(*entry));
+    tmp.chain = 0;
+    tmp.used  = entry->used;
+    *entry = tmp;
+    return true;
+  }
+
+
+  /**
+   * Offer a freshly decoded entry to the other CPUs.
+   */
+  void publish(CpuState *cpu, InstructionCacheEntry *entry)
+  {
+    Slot &s = slot(entry->phys, entry->cs_ar);
+    unsigned seq = s.seq;
+    if (seq & 1 || Cpu::cmpxchg4b(&s.seq, seq, seq + 1) != seq) return;
+    s.cs_ar      = entry->cs_ar;
+    s.generation = entry->generation;
+    s.phys       = entry->phys;
+    s.cpu        = cpu;
+    s.orig       = entry;
+    s.entry      = *entry;
+    asm volatile ("" : : : "memory");
+    s.seq = seq + 2;
+  }
+
+  SharedInstructionCache(unsigned size) : _size(size), _slots(new Slot[size]()) {}
 };
 
 
@@ -118,7 +230,10 @@ struct InstructionCacheEntry
 class InstructionCache : public MemTlb
 {
   enum EFLAGS {
+    EFL_CF  = 1 <<  0,
+    EFL_PF  = 1 <<  2,
     EFL_ZF  = 1 <<  6,
+    EFL_SF  = 1 <<  7,
     EFL_TF  = 1 <<  8,
     EFL_IF  = 1 <<  9,
     EFL_OF  = 1 << 11,
@@ -145,19 +260,53 @@ class InstructionCache : public MemTlb
     IC_RMW       = 1 <<  9,
     IC_MOFS      = 1 << 10,
     IC_QWORD     = 1 << 11,
+    IC_LOADCF    = 1 << 12,
+    IC_KEEPCF    = 1 << 13,
   };
 
 
-  enum {
-    SIZE = 64,
-    ASSOZ = 4
-  };
+  // the geometry of the cache, the number of sets is a power of two
+  unsigned _set_bits;
+  unsigned _assoz;
+  unsigned _clock;
+  unsigned *_tags;
+  InstructionCacheEntry *_values;
+  SharedInstructionCache *_shared;
+  unsigned slot(unsigned tag) { return ((tag ^ (tag >> _set_bits)) & ((1 << _set_bits) - 1)) * _assoz; }
+
+
+  // the maximum number of instructions executed in a single step
+  unsigned _max_block;
+  // the current block has to end after this instruction
+  bool     _block_end;
 
-  unsigned _pos;
-  unsigned _tags[SIZE*ASSOZ];
-  InstructionCacheEntry _values[SIZE*ASSOZ];
-  unsigned slot(unsigned tag) { return ((tag ^ (tag/SIZE)) % SIZE) * ASSOZ; }
+  // segments with base 0 and a 4G limit, that need no checks.  One
+  // bit for each of es..gs that can be read, bits 8-13 for writes.
+  unsigned  _flat_segments;
+
+  /**
+   * Recalculate the flat segments after a segment load.
+   *
+   * A present, 32-bit and page granular code or data segment
+   * qualifies, if its type allows the access and it is not expand
+   * down.  The DPL was checked when the segment was loaded and the
+   * accessed bit does not matter.
+   */
+  void update_flat_segments()
+  {
+    _flat_segments = 0;
+    for (unsigned i = 0; i < 6; i++) {
+      CpuState::Descriptor *desc = &_cpu->es + i;
+      if (~desc->limit || desc->base || (desc->ar & 0xc90) != 0xc90) continue;
+      bool code = desc->ar & 0x8;
+      if (code ? desc->ar & 0x2 : ~desc->ar & 0x4)  _flat_segments |= 1 << i;
+      if (!code && (desc->ar & 0x6) == 0x2)         _flat_segments |= 0x100 << i;
+    }
+  }
 
+  // the RAM page of the last code fetch of the current instruction
+  uintptr_t _fetch_virt;
+  char    * _fetch_ptr;
 
   // cpu state
   VCpu   * _vcpu;
@@ -168,14 +317,80 @@ class InstructionCache : public MemTlb
   mword _dr6;
   mword _dr[4];
   unsigned _fpustate [512/sizeof(unsigned)] __attribute__((aligned(16)));
+  // the guest FPU state is loaded into the host FPU
+  bool     _fpu_loaded;
+
+  /**
+   * Load the guest FPU state on the first FPU instruction of a step.
+   * Host code does not use the x87 unit, so the state stays loaded
+   * until the step ends.
+   */
+  void fpu_load()
+  {
+    if (_fpu_loaded) return;
+    asm volatile("fxrstor %0" : : "m"(_fpustate));
+    _fpu_loaded = true;
+  }
+
+
+  /**
+   * Write the guest FPU state back.  Only the x87 part is taken, as
+   * host code may have used the SSE registers in the meantime and no
+   * SSE instruction is emulated.
+   */
+  void fpu_save()
+  {
+    if (!_fpu_loaded) return;
+    unsigned state[512/sizeof(unsigned)] __attribute__((aligned(16)));
+    asm volatile("fxsave %0" : "=m"(state));
+    memcpy(_fpustate, state, 24);              // control, status, tag and pointers
+    memcpy(_fpustate + 8, state + 8, 8 * 16);  // st0-st7
+    _fpu_loaded = false;
+  }
+
 
   int send_message(CpuMessage::Type type)
   {
     CpuMessage msg(type, _cpu, _mtr_in);
+    device_lock(true);
     _vcpu->executor.send(msg, true);
+    _block_end = true;
     return _fault;
   }
 
+
+  enum {
+    // the rounds of a spin loop before the VCPU yields
+    SPIN_ROUNDS = 64
+  };
+  // the eip and the value of the last round of a spin loop
+  unsigned _spin_eip;
+  unsigned _spin_value;
+  unsigned _spin_count;
+
+  /**
+   * Detect a guest that spins on PAUSE or polls an I/O port that does
+   * not change.  A round counts if it hits the same eip with the same
+   * value and without a store to memory since the last one.  After
+   * SPIN_ROUNDS of them the VCPU is asked to give the host CPU away.
+   */
+  int spin_check(CpuMessage::Type type, unsigned value)
+  {
+    if (_stored || _oeip != _spin_eip || value != _spin_value) {
+      _spin_eip   = _oeip;
+      _spin_value = value;
+      _spin_count = 0;
+    }
+    else if (++_spin_count >= SPIN_ROUNDS) {
+      _spin_count = 0;
+      send_message(type);
+    }
+    _stored = false;
+    return _fault;
+  }
+
+  static int execute_pause(InstructionCache *cache) { return cache->spin_check(CpuMessage::TYPE_PAUSE, 0); }
+
   int event_injection()
   {
     if (_mtr_in & MTD_INJ && _cpu->inj_info & 0x80000000 && !idt_traversal(_cpu->inj_info, _cpu->inj_error)) {
@@ -186,6 +401,28 @@ class InstructionCache : public MemTlb
   };
 
 
+  /**
+   * Copy code bytes from the fetch window.  The window keeps the RAM
+   * page of the previous fetch, such that the bytes of an instruction
+   * need a single translation.  Returns false if the bytes are not in
+   * a RAM page.
+   */
+  bool fetch_window(unsigned virt, unsigned len, unsigned char *buffer)
+  {
+    if ((virt ^ (virt + len - 1)) & ~0xfff) return false;
+    if ((virt & ~0xfff) != _fetch_virt)
+      {
+	uintptr_t phys;
+	char *ptr = virt_to_host(virt, user_access(Type(TYPE_X | TYPE_R)), phys);
+	if (!ptr) return false;
+	_fetch_virt = virt & ~0xfff;
+	_fetch_ptr  = ptr - (virt & 0xfff);
+      }
+    memcpy(buffer, _fetch_ptr + (virt & 0xfff), len);
+    return true;
+  }
+
+
   /**
    * Fetch code.
    */
@@ -196,39 +433,105 @@ class InstructionCache : public MemTlb
     if ((~limit && limit < (virt + len - 1)) || ((entry->inst_len + len) > InstructionCacheEntry::MAX_INSTLEN)) GP0;
     virt += READ(cs).base;
 
-    read_code(virt, len, entry->data + entry->inst_len);
+    if (!fetch_window(virt, len, entry->data + entry->inst_len) && !_fault)
+      read_code(virt, len, entry->data + entry->inst_len);
     entry->inst_len += len;
     return _fault;
   }
 
 
+  /**
+   * Translate the next len code bytes to the physical address.
+   */
+  int code_page(unsigned len, uintptr_t &phys)
+  {
+    unsigned limit = READ(cs).limit;
+    if (~limit && limit < (_cpu->eip + len - 1)) GP0;
+    return code_phys(_cpu->eip + READ(cs).base, phys);
+  }
+
+
+  /**
+   * Revalidate an entry.  If the code page was not written since the
+   * last check, comparing the generation is enough.  Otherwise the
+   * cached bytes are compared with the code.
+   */
+  bool revalidate(unsigned i, unsigned cs_ar)
+  {
+    InstructionCacheEntry *entry = _values + i;
+
+    // two entries with different bases?
+    if (cs_ar != entry->cs_ar) return false;
+
+    uintptr_t phys = ~0ul;
+    unsigned generation = 0;
+    if (~entry->phys)
+      {
+	if (code_page(entry->inst_len, phys)) return false;
+	generation = CodeGeneration::get(phys >> 12);
+	if (phys == entry->phys && generation == entry->generation) return true;
+      }
+
+    InstructionCacheEntry tmp;
+    tmp.inst_len = 0;
+    if (fetch_code(&tmp, entry->inst_len)) return false;
+
+    // code modified?
+    if (memcmp(tmp.data, entry->data, entry->inst_len)) return false;
+    //COUNTER_INC("I$ recheck");
+    entry->phys = phys;
+    entry->generation = generation;
+    return true;
+  }
+
+
   /**
    * Find a cache entry for the given state and checks whether it is
-   * still valid.
+   * still valid.  The chain of the previous instruction is tried
+   * first.
    */
-  bool find_entry(unsigned &index)
+  bool find_entry(unsigned &index, unsigned chain)
   {
     unsigned cs_ar = READ(cs).ar;
     unsigned linear = _cpu->eip + READ(cs).base;
-    for (unsigned i = slot(linear); i < slot(linear) + ASSOZ; i++)
+    if (chain-- && linear == _tags[chain] && _values[chain].inst_len)
+      {
+	if (revalidate(chain, cs_ar))
+	  {
+	    index = chain;
+	    _values[index].used = ++_clock;
+	    COUNTER_INC("I$ chain");
+	    return true;
+	  }
+	if (_fault) return false;
+      }
+    unsigned first = slot(linear);
+    for (unsigned i = first; i < first + _assoz; i++)
       if (linear == _tags[i] &&  _values[i].inst_len)
 	{
-	  InstructionCacheEntry tmp;
-	  tmp.inst_len = 0;
-	  // revalidate entries
-	  if (fetch_code(&tmp, _values[i].inst_len)) return false;
-
-	  // either code modified or two entries with different bases?
-	  if (memcmp(tmp.data, _values[i].data, _values[i].inst_len) || cs_ar != _values[i].cs_ar)  continue;
+	  if (!revalidate(i, cs_ar))
+	    {
+	      if (_fault) return false;
+	      continue;
+	    }
 	  index = i;
-	  //COUNTER_INC("I$ ok");
+	  _values[index].used = ++_clock;
+	  COUNTER_INC("I$ hit");
 	  return true;
 	}
-    // allocate new invalid entry
-    index = slot(linear) + (_pos++ % ASSOZ);
+    COUNTER_INC("I$ miss");
+
+    // allocate new entry by replacing an invalid or the least recently used one
+    index = first;
+    for (unsigned i = first; i < first + _assoz && _values[index].inst_len; i++)
+      if (!_values[i].inst_len || _values[i].used < _values[index].used) index = i;
+    if (_values[index].inst_len) COUNTER_INC("I$ evict");
     memset(_values + index, 0, sizeof(*_values));
+    _values[index].used = ++_clock;
     _values[index].cs_ar =  cs_ar;
     _values[index].prefixes = 0x8300; // default is to use the DS segment
+    _values[index].ea = InstructionCacheEntry::effective_address<false, false>;
+    _values[index].run = execute_entry<0>;
     _tags[index] = linear;
     return false;
   }
@@ -256,6 +559,36 @@ class InstructionCache : public MemTlb
     if (disp)  fetch_code(_entry, 1 << (disp-1));
     _entry->modrminfo = info;
 
+    // select the effective address calculation for this form
+    unsigned char *disp_offset = _entry->data + _entry->inst_len - (disp ? 1 << (disp-1) : 0);
+    switch (disp)
+      {
+      case 1:  _entry->ea_disp = *reinterpret_cast<char  *>(disp_offset); break;
+      case 2:  _entry->ea_disp = *reinterpret_cast<short *>(disp_offset); break;
+      case 3:  _entry->ea_disp = *reinterpret_cast<int   *>(disp_offset); break;
+      default: _entry->ea_disp = 0; break;
+      }
+    bool base, index;
+    _entry->ea_base = info & 0x7;
+    if (info & MRM_SIB)
+      {
+	base  = ~info & MRM_NOBASE;
+	index = ~info & MRM_NOINDEX;
+	_entry->ea_index = (info >> 3) & 0x7;
+	_entry->ea_scale = (info >> 6) & 0x3;
+      }
+    else
+      {
+	base  = info & 0xf || info & MRM_EAX;
+	index = info & 0xf0;
+	_entry->ea_index = (info >> 4) & 0x7;
+	_entry->ea_scale = 0;
+      }
+    if (base)
+      _entry->ea = index ? InstructionCacheEntry::effective_address<true, true>  : InstructionCacheEntry::effective_address<true, false>;
+    else
+      _entry->ea = index ? InstructionCacheEntry::effective_address<false, true> : InstructionCacheEntry::effective_address<false, false>;
+
     // SS segment is default for this modrm?
     if (((_entry->prefixes & 0xff00) == 0x8300) && info & MRM_SS)
       _entry->prefixes = (_entry->prefixes & ~0xff00) | 0x200;
@@ -270,38 +603,67 @@ class InstructionCache : public MemTlb
 
 public:
   /**
-   * Decode the instruction.
+   * Decode the instruction.  The previous instruction of the block,
+   * if any, is chained to the new one.
    */
-  int get_instruction()
+  int get_instruction(InstructionCacheEntry *prev)
   {
     //COUNTER_INC("INSTR");
     unsigned index = 0;
-    if (!find_entry(index) && !_fault)
+
+    // the previous instruction may have changed the mappings
+    _fetch_virt = ~0ul;
+    if (!find_entry(index, prev ? prev->chain : 0) && !_fault)
       {
 	_entry = _values + index;
 	_entry->address_size = _entry->operand_size = ((_entry->cs_ar >> 10) & 1) + 1;
-	for (int op_mode = 0; !_entry->execute && !_fault; )
-	  {
-	    /**
-	     * Handle a new byte of the instruction.
-	     *
-	     * The op_mode, keeps track which parts of the opcode bytes have
-	     * already been seen.  Negative if the whole instruction is fetched.
-	     */
-	    fetch_code(_entry, 1) || handle_code_byte(_entry, _entry->data[_entry->inst_len-1], op_mode);
-	  }
-	if (_fault)
+
+	// remember the generation of the page before the code is read
+	uintptr_t phys = 0;
+	unsigned generation = 0;
+	if (!code_page(1, phys))  generation = CodeGeneration::get(phys >> 12);
+
+	// another VCPU may have decoded the instruction already
+	unsigned limit = READ(cs).limit;
+	if (!_fault && _shared && _shared->lookup(phys, _entry->cs_ar, generation, ~limit ? limit + 1 - _cpu->eip : ~0u, _cpu, _entry))
+	  COUNTER_INC("I$ shared");
+	else
 	  {
-	    // invalidate entry
-	    _entry->inst_len = 0;
-	    Logging::printf("decode fault %x\n", _fault);
-	    return _fault;
-	  }
+	    for (int op_mode = 0; !_entry->execute && !_fault; )
+	      {
+		/**
+		 * Handle a new byte of the instruction.
+		 *
+		 * The op_mode, keeps track which parts of the opcode bytes have
+		 * already been seen.  Negative if the whole instruction is fetched.
+		 */
+		fetch_code(_entry, 1) || handle_code_byte(_entry, _entry->data[_entry->inst_len-1], op_mode);
+	      }
+	    if (_fault)
+	      {
+		// invalidate entry
+		_entry->inst_len = 0;
+		Logging::printf("decode fault %x\n", _fault);
+		return _fault;
+	      }
 
-	assert(_values[index].execute);
-	//COUNTER_INC("decoded");
+	    assert(_values[index].execute);
+
+	    // a LOCK prefix is only allowed on some instructions with a memory operand
+	    if (((_entry->prefixes & 0xff) == 0xf0) && ((~_entry->flags & IC_LOCK) || (_entry->modrminfo & MRM_REG)))
+	      _entry->run = execute_bad_lock;
+	    // PAUSE is a NOP with a REP prefix
+	    if ((_entry->prefixes & 0xff) == 0xf3 && _entry->offset_opcode == _entry->inst_len && _entry->data[_entry->inst_len - 1] == 0x90)
+	      _entry->run = execute_pause;
+	    unsigned linear = _cpu->eip + READ(cs).base;
+	    _entry->phys = ((linear ^ (linear + _entry->inst_len - 1)) & ~0xfff) ? ~0ul : phys;
+	    _entry->generation = generation;
+	    if (_shared && ~_entry->phys) _shared->publish(_cpu, _entry);
+	    //COUNTER_INC("decoded");
+	  }
       }
     _entry = _values + index;
+    if (prev) prev->chain = index + 1;
     _cpu->eip += _entry->inst_len;
     if (debug) {
 	Logging::printf("eip %x:%x esp %x eax %x ebp %x prefix %x\n", _cpu->cs.sel, _oeip, _oesp, _cpu->eax, _cpu->ebp, _entry->prefixes);
@@ -333,31 +695,7 @@ public:
 
   unsigned modrm2virt()
   {
-    unsigned short info = _entry->modrminfo;
-    unsigned virt = 0;
-    unsigned char *disp_offset = _entry->data + _entry->offset_opcode + 1;
-    if (info & MRM_SIB)
-      {
-	// add base + scaled index
-	if (~info & MRM_NOBASE)   virt += _cpu->gpr[info & 0x7];
-	if (~info & MRM_NOINDEX)  virt += _cpu->gpr[(info >> 3) & 0x7] << ((info >> 6) & 0x3);
-	disp_offset++;
-      }
-    else
-      {
-	if (info & 0xf || info & MRM_EAX) virt += _cpu->gpr[info & 0x7];
-	if (info & 0xf0) virt += _cpu->gpr[(info >> 4) & 0x7];
-      }
-
-    unsigned disp = ((info >> MRM_DISSHIFT) & 0x3);
-    switch (disp)
-      {
-      case 1:  virt += *reinterpret_cast<char  *>(disp_offset); break;
-      case 2:  virt += *reinterpret_cast<short *>(disp_offset); break;
-      case 3:  virt += *reinterpret_cast<int   *>(disp_offset); break;
-      default:
-	break;
-      }
+    unsigned virt = _entry->ea(_entry, _cpu->gpr);
     if (_entry->flags & IC_BITS)
       {
 	unsigned bitofs = *get_reg32((_entry->data[_entry->offset_opcode] >> 3) & 0x7);
@@ -400,17 +738,34 @@ public:
 #    define CLOBBER      "memory"
 #endif
 
+  /**
+   * Call an assembler snippet.  A popf is only done for the few
+   * instructions that consume more than the carry flag, which is
+   * loaded with a bt instead.  Instructions that keep the carry flag
+   * (inc, dec) do not need to load it at all, as it is not merged
+   * back.
+   */
+  template<unsigned flags>
   void call_asm(void *tmp_src, void *tmp_dst)
   {
     mword tmp_flag;
     unsigned dummy1, dummy2, dummy3;
-    switch (_entry->flags & (IC_LOADFLAGS | IC_SAVEFLAGS))
+    const unsigned mask = (flags & IC_KEEPCF) ? 0x8d4 : 0x8d5;
+    switch (flags & (IC_LOADFLAGS | IC_LOADCF | IC_SAVEFLAGS))
       {
       case IC_SAVEFLAGS:
 	asm volatile ("call *%4; pushf; pop %3"
 		      : PARAM1(dummy1), PARAM2(dummy2), PARAM3(dummy3), "=g"(tmp_flag)
 		      : "m"(_entry->execute), "0"(this), "1"(tmp_src), "2"(tmp_dst) : CLOBBER);
-	_cpu->efl = (_cpu->efl & ~0x8d5) | (tmp_flag  & 0x8d5);
+	_cpu->efl = (_cpu->efl & ~mask) | (tmp_flag  & mask);
+	_mtr_out |= MTD_RFLAGS;
+	break;
+      case IC_LOADCF | IC_SAVEFLAGS:
+	tmp_flag = _cpu->efl;
+	asm volatile ("bt $0, %3; call *%4; pushf; pop %3"
+		      : PARAM1(dummy1), PARAM2(dummy2), PARAM3(dummy3), "+r"(tmp_flag)
+		      : "m"(_entry->execute), "0"(this), "1"(tmp_src), "2"(tmp_dst) : CLOBBER);
+	_cpu->efl = (_cpu->efl & ~mask) | (tmp_flag  & mask);
 	_mtr_out |= MTD_RFLAGS;
 	break;
       case IC_LOADFLAGS:
@@ -437,45 +792,50 @@ public:
 
 
   /**
-   * Execute the instruction.
+   * Execute an instruction with the given flags.  The decoder selects
+   * the instantiation, so no flags are tested at runtime.
    */
-  int execute()
+  template<unsigned flags>
+  int execute_flags()
   {
-
     //COUNTER_INC("executed");
-    assert(_entry->execute);
-    unsigned length = (_entry->flags & IC_BYTE) ? 1 : (_entry->flags & IC_QWORD ? 8 : 1 << _entry->operand_size);
+    unsigned length = (flags & IC_BYTE) ? 1 : (flags & IC_QWORD ? 8 : 1 << _entry->operand_size);
     void *tmp_src   = _entry->src;
     void *tmp_dst   = _entry->dst;
 
-    if (((_entry->prefixes & 0xff) == 0xf0) && ((~_entry->flags & IC_LOCK) || (_entry->modrminfo & MRM_REG))) {
-      Logging::panic("LOCK prefix %02x%02x%02x%02x at eip %x:%x\n", _entry->data[0], _entry->data[1], _entry->data[2], _entry->data[3], _cpu->cs.sel, _cpu->eip);
-      UD0;
-    }
-
-    Type type = TYPE_R;
-    if (!(_entry->flags & (IC_DIRECTION | IC_READONLY))) type = TYPE_W;
-    if (_entry->flags & IC_RMW) type = Type(type | TYPE_R);
-    if (_entry->flags & IC_MODRM)
+    const Type type = Type(((flags & (IC_DIRECTION | IC_READONLY)) ? TYPE_R : TYPE_W) | ((flags & IC_RMW) ? TYPE_R : 0));
+    const bool locked = flags & IC_LOCK && (_entry->prefixes & 0xff) == 0xf0;
+    if (flags & IC_MODRM)
       {
-	if (modrm2mem(tmp_dst, length, type)) return _fault;
+	_lock_operand = locked;
+	int fault = modrm2mem(tmp_dst, length, type);
+	_lock_operand = false;
+	if (fault) return _fault;
       }
-    if (_entry->flags & IC_MOFS)
+    if (flags & IC_MOFS)
       {
 	unsigned virt = 0;
 	move(&virt, _entry->data+_entry->offset_opcode, _entry->address_size);
 	if (virt_to_ptr(tmp_dst, length, type, virt)) return _fault;
       }
-    if (_entry->flags & IC_DIRECTION)
+    if (flags & IC_DIRECTION)
       {
 	void *tmp = tmp_src;
 	tmp_src = tmp_dst;
 	tmp_dst = tmp;
       }
-    if (_entry->flags & IC_ASM)
-      call_asm(tmp_src, tmp_dst);
+
+    /**
+     * A host lock on a RAM operand is atomic against the other VCPUs,
+     * unless one of them works on a buffered copy of it.
+     */
+    if (locked && _bus_locked) COUNTER_INC("lock buffered");
+    if (locked && !_bus_locked) bus_lock().enter_shared();
+    if (flags & IC_ASM)
+      call_asm<flags>(tmp_src, tmp_dst);
     else
       _entry->execute(this, tmp_src, tmp_dst);
+    if (locked && !_bus_locked) bus_lock().leave_shared();
 
     /**
      * Have we accessed more than we are allowed to?
@@ -491,6 +851,31 @@ public:
     return _fault;
   }
 
+  template<unsigned flags>
+  static int execute_entry(InstructionCache *cache) { return cache->execute_flags<flags>(); }
+
+
+  /**
+   * An instruction with an invalid LOCK prefix.
+   */
+  int bad_lock()
+  {
+    Logging::panic("LOCK prefix %02x%02x%02x%02x at eip %x:%x\n", _entry->data[0], _entry->data[1], _entry->data[2], _entry->data[3], _cpu->cs.sel, _cpu->eip);
+    UD0;
+  }
+
+  static int execute_bad_lock(InstructionCache *cache) { return cache->bad_lock(); }
+
+
+  /**
+   * Execute the instruction.
+   */
+  int execute()
+  {
+    assert(_entry->run);
+    return _entry->run(this);
+  }
+
 
   /**
    * Commits the instruction by setting the appropriate UTCB fields.
@@ -541,6 +926,7 @@ public:
 		_cpu->inj_info = 0;
 		// triple fault
 		CpuMessage msg(CpuMessage::TYPE_TRIPLE, _cpu, _mtr_in);
+		device_lock(true);
 		_vcpu->executor.send(msg, true);
 	      }
 	    else
@@ -562,23 +948,61 @@ public:
 
 public:
 
+  /**
+   * Execute a block of instructions.
+   *
+   * The block ends at the first instruction that faults, does I/O,
+   * touches MMIO, or that could make an event injectable.  It also
+   * ends after max_block instructions, when a new event arrives, or
+   * at the deadline of the message.  Blocks are chained through the
+   * cache entries.
+   *
+   * The device lock is released until we have to talk to a device.
+   */
   void step(CpuMessage &msg) {
     _cpu = msg.cpu;
     _mtr_in = msg.mtr_in;
     _mtr_out =  msg.mtr_out;
     _fault = 0;
+    device_lock(false);
+    update_flat_segments();
     if (!init()) {
       _entry = 0;
-      _oeip = _cpu->eip;
-      _oesp = _cpu->esp;
-      _ointr_state = _cpu->intr_state;
-      // remove sti+movss blocking
-      _cpu->intr_state &= ~3;
-      event_injection() || get_instruction() || execute();
-      if (commit()) invalidate(true);
+      for (unsigned count = 1; ; count++) {
+	InstructionCacheEntry *prev = _entry;
+	_entry = 0;
+	_block_end = false;
+	_mmio = false;
+	_oeip = _cpu->eip;
+	_oesp = _cpu->esp;
+	_ointr_state = _cpu->intr_state;
+	unsigned oefl = _cpu->efl;
+	// remove sti+movss blocking
+	_cpu->intr_state &= ~3;
+	event_injection() || get_instruction(prev) || execute();
+	if (!commit()) break;
+	invalidate(true);
+
+	if (_fault)      { COUNTER_INC("I$ end fault"); break; }
+	if (_block_end)  { COUNTER_INC("I$ end exit");  break; }
+	if (_mmio)       { COUNTER_INC("I$ end mmio");  break; }
+	// a pending IRQ could be injected now or the guest wants to single step
+	if (_cpu->intr_state & 3 || ~oefl & _cpu->efl & EFL_IF || _cpu->efl & EFL_TF) { COUNTER_INC("I$ end window"); break; }
+	if (_vcpu->event_arrived) { COUNTER_INC("I$ end event"); break; }
+	if (count >= _max_block)  { COUNTER_INC("I$ end quantum"); break; }
+	if (~msg.deadline && Cpu::rdtsc() >= msg.deadline) { COUNTER_INC("I$ end deadline"); break; }
+      }
     }
+    // a failed commit skips the writeback
+    stored();
+    bus_unlock();
+    fpu_save();
+    device_lock(true);
     msg.mtr_out = _mtr_out;
   }
 
- InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
+ InstructionCache(VCpu *vcpu, DBus<MessageHostOp> &hostop, unsigned max_block, unsigned set_bits, unsigned assoz, SharedInstructionCache *shared)
+   : MemTlb(vcpu->mem, vcpu->memregion, hostop), _set_bits(set_bits), _assoz(assoz), _clock(),
+     _tags(new unsigned[assoz << set_bits]()), _values(new InstructionCacheEntry[assoz << set_bits]()), _shared(shared),
+     _max_block(max_block), _block_end(), _flat_segments(), _fetch_virt(~0ul), _fetch_ptr(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate(), _fpu_loaded(), _spin_eip(), _spin_value(), _spin_count() { }
 };
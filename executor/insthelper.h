@@ -39,7 +39,7 @@ int cpl0_test() {
       }
     else
       if (_entry->address_size == 1) virt &= 0xffff;
-    if (!(~desc->limit) && !desc->base && desc->ar == 0xc93) return 0;
+    if (_flat_segments & ((write ? 0x100 : 1) << (desc - &_cpu->es))) return 0;
 
     // limit check
     bool fault = virt > desc->limit ||  (virt + length - 1) > desc->limit;
@@ -96,9 +96,28 @@ template<unsigned operand_size> static void move(void *tmp_dst, void *tmp_src) {
     return 0;
   }
 
-  template<unsigned operand_size>
-  static int __attribute__((regparm(3))) helper_JMP_static(InstructionCache *cache, void *tmp_src)
-  { return cache->helper_JMP<operand_size>(tmp_src); }
+  /**
+   * Evaluate the condition of a Jcc, SETcc or CMOVcc from the guest
+   * flags.  The conditions are numbered like the Jcc opcodes, an odd
+   * number negates the even one.
+   */
+  bool helper_condition(unsigned cc)
+  {
+    unsigned efl = _cpu->efl;
+    bool res;
+    switch (cc >> 1)
+      {
+      case 0:  res = efl & EFL_OF; break;
+      case 1:  res = efl & EFL_CF; break;
+      case 2:  res = efl & EFL_ZF; break;
+      case 3:  res = efl & (EFL_CF | EFL_ZF); break;
+      case 4:  res = efl & EFL_SF; break;
+      case 5:  res = efl & EFL_PF; break;
+      case 6:  res = !(efl & EFL_SF) != !(efl & EFL_OF); break;
+      default: res = efl & EFL_ZF || !(efl & EFL_SF) != !(efl & EFL_OF); break;
+      }
+    return res ^ (cc & 1);
+  }
 
   /**
    * Do an unconditional JMP.
@@ -308,7 +327,16 @@ helper_SDT(SGDT,gd, MTD_GDTR)
   {
     // XXX check IOPBM
     CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in);
+    device_lock(true);
     _vcpu->executor.send(msg, true);
+    _block_end = true;
+
+    // an IN to a register may poll a device, INS does not
+    if (dst == &_cpu->eax) {
+      unsigned value = 0;
+      move<operand_size>(&value, dst);
+      spin_check(CpuMessage::TYPE_POLL, value);
+    }
   }
 
   template<unsigned operand_size>
@@ -317,7 +345,9 @@ helper_SDT(SGDT,gd, MTD_GDTR)
 
     // XXX check IOPBM
     CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in);
+    device_lock(true);
     _vcpu->executor.send(msg, true);
+    _block_end = true;
   }
 
 /**
@@ -329,7 +359,7 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
   entry2.flags = IC_SAVEFLAGS;
   InstructionCacheEntry *old = _entry;
   _entry = &entry2;
-  call_asm(src, dst);
+  call_asm<IC_SAVEFLAGS>(src, dst);
   _entry = old;
   return _fault;
 }
@@ -343,16 +373,162 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
     SH_SAVE_EAX = 1 << 3,
     SH_DOOP_CMP = 1 << 4,
     SH_DOOP_IN  = 1 << 5,
-    SH_DOOP_OUT = 1 << 6
+    SH_DOOP_OUT = 1 << 6,
+    STRING_CHUNKS = 16,
   };
 
+  /**
+   * Get a host pointer to count string elements in a single RAM page
+   * that start at a segment offset and go into the direction of the
+   * DF.  The count is reduced to the elements up to the page boundary.
+   * Returns false if the slow path has to be used, e.g. for MMIO,
+   * unusual segments or an element crossing the page.
+   */
+  template<unsigned operand_size>
+  bool string_range(CpuState::Descriptor *desc, unsigned offset, bool write, unsigned &count, char *&ptr, uintptr_t &phys)
+  {
+    const unsigned size = 1 << operand_size;
+    bool down = _cpu->efl & 0x400;
+    unsigned linear = desc->base + offset;
+    unsigned page_offset = linear & 0xfff;
+    if (page_offset + size > 0x1000) return false;
+    unsigned elements = down ? page_offset / size + 1 : (0x1000 - page_offset) / size;
+    if (count > elements) count = elements;
+
+    // only expand-up and accessible segments without wraparound
+    unsigned start = down ? offset - (count - 1) * size : offset;
+    unsigned last  = start + count * size - 1;
+    if ((desc->ar & 0xc) == 4 || ~desc->ar & 0x80 || start > offset || last < start || last > desc->limit) return false;
+    if (write ? (desc->ar & 0xa) != 0x2 : (desc->ar & 0xa) == 0x8) return false;
+
+    ptr = virt_to_host(linear, user_access(write ? TYPE_W : TYPE_R), phys);
+    if (!ptr) return false;
+    ptr  -= offset - start;
+    phys -= offset - start;
+    return true;
+  }
+
+
+  /**
+   * Execute a chunk of a REP MOVS, STOS, CMPS or SCAS with host memory
+   * operations.  The chunk ends at the next page boundary of the
+   * source or destination.  Returns the number of elements done, zero
+   * if the next element has to use the slow path.
+   */
+  template<unsigned feature, unsigned operand_size>
+  unsigned string_bulk()
+  {
+    const unsigned size = 1 << operand_size;
+    unsigned count = _cpu->ecx;
+    char *src = reinterpret_cast<char *>(&_cpu->eax), *dst = 0;
+    uintptr_t src_phys, dst_phys;
+    CpuState::Descriptor *seg = (&_cpu->es) + ((_entry->prefixes >> 8) & 0xf);
+    if (feature & SH_LOAD_ESI && !string_range<operand_size>(seg, _cpu->esi, false, count, src, src_phys)) return 0;
+    unsigned src_count = count;
+    if (!string_range<operand_size>(&_cpu->es, _cpu->edi, feature & SH_SAVE_EDI, count, dst, dst_phys)) return 0;
+
+    // a backward source range starts higher if the destination shortened the chunk
+    if (feature & SH_LOAD_ESI && count != src_count && !string_range<operand_size>(seg, _cpu->esi, false, count, src, src_phys)) return 0;
+
+    unsigned bytes = count * size;
+    int step = (_cpu->efl & 0x400) ? -size : size;
+    if (feature & SH_DOOP_CMP) {
+      // compare in the order of the DF and stop at the REPE/REPNE condition
+      char *s = src, *d = dst;
+      if (step < 0) { d += bytes - size; if (feature & SH_LOAD_ESI) s += bytes - size; }
+      bool repe = (_entry->prefixes & 0xff) == 0xf3;
+      unsigned i = 0;
+      while (i < count) {
+	bool equal = !memcmp(s, d, size);
+	i++;
+	if (equal != repe || i == count) break;
+	d += step;
+	if (feature & SH_LOAD_ESI) s += step;
+      }
+      calc_flags(operand_size, s, d);
+      return i;
+    }
+
+    if (feature & SH_LOAD_ESI) {
+      // MOVS: overlapping copies have to replicate like single moves
+      if (dst + bytes <= src || src + bytes <= dst)
+	memcpy(dst, src, bytes);
+      else if (step > 0)
+	for (unsigned i = 0; i < bytes; i += size) move<operand_size>(dst + i, src + i);
+      else
+	for (unsigned i = bytes; i; i -= size) move<operand_size>(dst + i - size, src + i - size);
+    }
+    else if (!operand_size)
+      memset(dst, _cpu->al, bytes);
+    else
+      for (unsigned i = 0; i < bytes; i += size) move<operand_size>(dst + i, &_cpu->eax);
+    CodeGeneration::modified(dst_phys, bytes);
+    return count;
+  }
+
+
+  /**
+   * Execute a chunk of a REP INS or OUTS with a single counted I/O
+   * message.  The chunk ends at the next page boundary.  Returns the
+   * number of elements the device has moved.
+   */
+  template<unsigned feature, unsigned operand_size>
+  unsigned string_io()
+  {
+    const bool in = feature & SH_DOOP_IN;
+    unsigned count = _cpu->ecx;
+    char *ptr;
+    uintptr_t phys;
+    if (in && !string_range<operand_size>(&_cpu->es, _cpu->edi, true, count, ptr, phys)) return 0;
+    if (!in && !string_range<operand_size>((&_cpu->es) + ((_entry->prefixes >> 8) & 0xf), _cpu->esi, false, count, ptr, phys)) return 0;
+
+    // XXX check IOPBM
+    CpuMessage msg(in, _cpu, operand_size, _cpu->dx, ptr, _mtr_in, count);
+    device_lock(true);
+    _vcpu->executor.send(msg, true);
+    _block_end = true;
+    count -= msg.count;
+    if (in && count) CodeGeneration::modified(phys, count << operand_size);
+    return count;
+  }
+
+
 #define NCHECK(X)  { if (X) break; }
 #define FEATURE(X,Y) { if (feature & (X)) Y; }
   template<unsigned feature, unsigned operand_size>
   int __attribute__((regparm(3)))  string_helper()
   {
+    // REP MOVS, STOS, CMPS and SCAS with 32-bit addresses can work on whole pages,
+    // forward INS and OUTS ask the device for a block transfer
+    const bool io = feature & (SH_DOOP_IN | SH_DOOP_OUT);
+    bool bulk = !(feature & SH_SAVE_EAX) && _entry->prefixes & 0xff && _entry->address_size == 2 && !(io && _cpu->efl & 0x400);
+    unsigned chunks = 0;
     while (_entry->address_size == 1 && _cpu->cx || _entry->address_size == 2 && _cpu->ecx || !(_entry->prefixes & 0xff))
       {
+	if (bulk) {
+	  unsigned count = io ? string_io<feature, operand_size>() : string_bulk<feature, operand_size>();
+	  if (_fault) break;
+
+	  // the device does not know counted I/O, do it element by element
+	  if (io && !count)  bulk = false;
+	  if (count) {
+	    int size = (_cpu->efl & 0x400) ? -(count << operand_size) : (count << operand_size);
+	    FEATURE(SH_LOAD_ESI, _cpu->esi += size);
+	    FEATURE(SH_LOAD_EDI | SH_SAVE_EDI, _cpu->edi += size);
+	    _cpu->ecx -= count;
+	    FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf3)  && (~_cpu->efl & 0x40))  break);
+	    FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf2)  && ( _cpu->efl & 0x40))  break);
+
+	    // restart the instruction to give pending events a chance
+	    if (_cpu->ecx && ++chunks >= STRING_CHUNKS) {
+	      _cpu->eip = _oeip;
+	      _block_end = true;
+	      break;
+	    }
+	    continue;
+	  }
+	}
+
 	void *src = &_cpu->eax;
 	void *dst = &_cpu->eax;
 
@@ -413,15 +589,14 @@ int helper_MOV__EDX__CR0()
     {
     case 0: if (tmp & 0x1ffaffc0U) GP0;  tmp_dst = &_cpu->cr0; tmp |= 0x10; break;
     case 2: tmp_dst = &_cpu->cr2; break;
-    case 3: tmp_dst = &_cpu->cr3; break;
+    case 3: tmp_dst = &_cpu->cr3; tlb_cr3_write(); break;
     case 4: if (tmp & 0xffff9800U) GP0;  tmp_dst = &_cpu->cr4; break;
     default: UD0;
     }
   *tmp_dst = tmp;
   _mtr_out |= MTD_CR;
 
-  // XXX flush only if paging-bits change
-  // update TLB
+  // update TLB, this flushes only if cr3 or the paging-bits change
   return init();
 }
 
@@ -572,13 +747,14 @@ int helper_LLDT(unsigned short selector)
 }
 
 
-static void set_realmode_segment(CpuState::Descriptor *seg, unsigned short sel, bool v86mode) {
+void set_realmode_segment(CpuState::Descriptor *seg, unsigned short sel, bool v86mode) {
 
   if (v86mode)
     seg->set(sel, sel << 4, 0xffff, 0xf3);
   else
    // there is no limit and attribute modification in realmode
    seg->set(sel, sel << 4, seg->limit, seg->ar);
+  update_flat_segments();
 }
 
 
@@ -595,6 +771,7 @@ int set_segment(CpuState::Descriptor *seg, unsigned short sel, bool cplcheck = t
 	{
 	  seg->sel = sel;
 	  seg->ar = 0x1000;
+	  update_flat_segments();
 	  return _fault;
 	}
 
@@ -609,6 +786,7 @@ int set_segment(CpuState::Descriptor *seg, unsigned short sel, bool cplcheck = t
 	  if (~desc.ar0 & 0x80) is_ss ? (SS(sel)) : (NP(sel));
 	  desc_set_flag(desc, sel, 0x1, false);
 	  desc.to_cpustate(seg, sel);
+	  update_flat_segments();
 	}
     }
   return _fault;
@@ -635,6 +813,7 @@ int helper_far_jmp(unsigned tmp_cs, unsigned tmp_eip, unsigned tmp_flag)
 	  desc_set_flag(desc, tmp_cs, 0x1, false);
 	  // XXX ring transistions and task switch and call gates
 	  desc.to_cpustate(&_cpu->cs, tmp_cs);
+	  update_flat_segments();
 	  _cpu->eip = tmp_eip;
 	  _cpu->efl = tmp_flag | 2;
 	}
@@ -732,6 +911,7 @@ int helper_IRET()
 	  // ring transistions??
 	  desc_set_flag(desc, tmp_cs, 0x1, false);
 	  desc.to_cpustate(&_cpu->cs, tmp_cs);
+	  update_flat_segments();
 	  _cpu->eip = tmp_eip;
 	  _cpu->efl = tmp_flag | 2;
 	}
@@ -809,6 +989,7 @@ int idt_traversal(unsigned event, unsigned error_code)
 			|| helper_PUSH<2>(&_oesp))
 		      {
 			_cpu->ss = oldss;
+			update_flat_segments();
 			return _fault;
 		      }
 		  }
@@ -819,11 +1000,13 @@ int idt_traversal(unsigned event, unsigned error_code)
 		    || has_errorcode && helper_PUSH<2>(&error_code))
 		  {
 		    _cpu->ss = oldss;
+		    update_flat_segments();
 		    return _fault;
 		  }
 		_cpu->efl &= ~(EFL_VM | EFL_TF | EFL_RF | EFL_NT);
 		if ((idt.ar0 & 0x1f) == 0xe)  _cpu->efl &= ~EFL_IF;
 		desc.to_cpustate(&_cpu->cs, idt.base0);
+		update_flat_segments();
 		_cpu->eip = idt.offset();
 	      }
 	    else
@@ -868,6 +1051,7 @@ int idt_traversal(unsigned event, unsigned error_code)
 		    break;
 		  }
 		desc.to_cpustate(&_cpu->cs, idt.base0);
+		update_flat_segments();
 		_cpu->eip = idt.offset();
 		break;
 	      }
@@ -884,7 +1068,14 @@ int idt_traversal(unsigned event, unsigned error_code)
 
 
 int helper_INT(unsigned char vector) { return idt_traversal(0x80000600 | vector, 0); }
-int helper_INVLPG() { return _fault; }
+int helper_INVLPG()
+{
+  // no limit checks are done here
+  unsigned virt = modrm2virt();
+  if (_entry->address_size == 1) virt &= 0xffff;
+  tlb_flush_page(virt + ((&_cpu->es) + ((_entry->prefixes >> 8) & 0x0f))->base);
+  return _fault;
+}
 int helper_FWAIT()                              { return _fault; }
 int helper_MOV__DB0__EDX()
 {
@@ -929,6 +1120,7 @@ int helper_FXSAVE()
 {
   unsigned virt = modrm2virt();
   if (virt & 0xf) GP0; // could be also AC if enabled
+  fpu_save();
   for (unsigned i=0; i < sizeof(_fpustate)/sizeof(unsigned); i++)
     {
       void *addr = nullptr;
@@ -16,6 +16,7 @@
  * General Public License version 2 for more details.
  */
 #pragma once
+#include "nul/codegen.h"
 
 #define READ(NAME) ({ _mtr_read |= RMTR_##NAME; _cpu->NAME; })
 #define WRITE(NAME) ({							\
@@ -37,6 +38,39 @@
 #define PF(ADDR, ERR) { _cpu->cr2 = ADDR; _mtr_out |= MTD_CR; EXCEPTION(this, 0xe, ERR); return _fault; }
 
 
+/**
+ * Serializes the LOCKed instructions of all VCPUs.  The ones that
+ * use a host lock on their RAM operand enter it shared.  The ones
+ * that work on a buffer (MMIO or two distant frames) enter it
+ * exclusively, which is only done with the device lock held, thus
+ * there is never more than one waiting for it.
+ */
+class BusLock
+{
+  enum { EXCLUSIVE = 1u << 31 };
+  volatile unsigned _value;
+public:
+  void enter_shared()
+  {
+    unsigned value;
+    do
+      while ((value = _value) & EXCLUSIVE) Cpu::pause();
+    while (Cpu::cmpxchg4b(&_value, value, value + 1) != value);
+  }
+
+  void leave_shared() { Cpu::atomic_xadd(&_value, -1); }
+
+  void enter_exclusive()
+  {
+    // new readers wait from now on, the current ones have to leave
+    Cpu::atomic_or<volatile unsigned>(&_value, EXCLUSIVE);
+    while (_value != EXCLUSIVE) Cpu::pause();
+  }
+
+  void leave_exclusive() { Cpu::atomic_and<volatile unsigned>(&_value, ~EXCLUSIVE); }
+};
+
+
 /**
  * A cache for physical memory indexed by page number.
  */
@@ -51,6 +85,99 @@ protected:
   unsigned  _mtr_in;
   unsigned  _mtr_read;
   unsigned  _mtr_out;
+  // set if an access could not be satisfied from RAM
+  bool      _mmio;
+  // the frontend lock is not held while we touch only RAM
+  DBus<MessageHostOp> &_hostop;
+  bool      _unlocked;
+  // the next access is the operand of a LOCKed instruction
+  bool      _lock_operand;
+  // we hold the bus lock exclusively until the writeback
+  bool      _bus_locked;
+
+
+  /**
+   * The bus lock shared by all VCPUs.
+   */
+  static BusLock &bus_lock()
+  {
+    static BusLock lock;
+    return lock;
+  }
+
+
+  enum { WRITES = 4 };
+  // the RAM ranges the current instruction stores to directly
+  struct { uintptr_t phys; size_t len; } _writes[WRITES];
+  unsigned _write_count;
+
+
+  /**
+   * The instruction is about to store directly to RAM.  Decoded code
+   * on these pages is invalid now.  As another VCPU could revalidate
+   * it against the old bytes before the store happens, the generation
+   * is bumped again in stored().
+   */
+  void will_store(uintptr_t phys, size_t len)
+  {
+    CodeGeneration::modified(phys, len);
+    if (_write_count < WRITES) {
+      _writes[_write_count].phys = phys;
+      _writes[_write_count].len  = len;
+    }
+    _write_count++;
+  }
+
+
+  /**
+   * The stores of the instruction are done.
+   */
+  void stored()
+  {
+    if (_write_count > WRITES)  CodeGeneration::modified_all();
+    else
+      for (unsigned i = 0; i < _write_count; i++)
+	CodeGeneration::modified(_writes[i].phys, _writes[i].len);
+    _write_count = 0;
+  }
+
+
+  /**
+   * Release the bus lock, if we took it for a buffered operand.
+   */
+  void bus_unlock()
+  {
+    if (!_bus_locked) return;
+    bus_lock().leave_exclusive();
+    _bus_locked = false;
+  }
+
+
+  /**
+   * Take or release the device lock of the frontend.  Frontends that
+   * do not know the lock keep us running with it.
+   */
+  void device_lock(bool lock)
+  {
+    if (lock != _unlocked) return;
+    MessageHostOp msg(lock ? MessageHostOp::OP_DEVICE_LOCK : MessageHostOp::OP_DEVICE_UNLOCK, 0UL);
+    if (_hostop.send(msg, true)) _unlocked = !lock;
+  }
+
+
+  /**
+   * Ask the devices for a direct reference to guest memory.  The
+   * receivers may look at device state, thus the lock is held during
+   * the send.  It is dropped again, if we ran without it before.
+   */
+  bool memregion(MessageMemRegion &msg)
+  {
+    bool unlocked = _unlocked;
+    device_lock(true);
+    bool res = _memregion.send(msg, true);
+    if (unlocked) device_lock(false);
+    return res;
+  }
 private:
   enum {
     SIZE = 64,
@@ -123,6 +250,7 @@ private:
     assert(!(_buffers[index]._len & 3));
     assert(!(_buffers[index]._phys1 & 3));
 
+    device_lock(true);
     uintptr_t address = _buffers[index]._phys1;
     for (size_t i=0; i < _buffers[index]._len; i += 4) {
       MessageMem msg2(read, address, reinterpret_cast<unsigned *>(_buffers[index].data + i));
@@ -193,6 +321,12 @@ public:
     assert(!(phys1 & 3));
     assert(!(len & 3));
 
+    // invalidate the code on the written pages
+    if (type & TYPE_W) {
+      will_store(phys1, 1);
+      if (phys2 != ~0xffful) will_store(phys2, 1);
+    }
+
     // XXX simplify it by relying on memory ranges
     {
       unsigned s = slot(phys1);
@@ -214,7 +348,7 @@ public:
 
       // try to get a direct memory reference
       MessageMemRegion msg1(phys1 >> 12);
-      if (supported && _memregion.send(msg1, true) && msg1.ptr && ((phys1 + len) <= ((msg1.start_page + msg1.count) << 12))) {
+      if (supported && memregion(msg1) && msg1.ptr && ((phys1 + len) <= ((msg1.start_page + msg1.count) << 12))) {
 	CacheEntry *res = _sets[s]._values + entry;
 	res->_ptr = msg1.ptr + (phys1 - (msg1.start_page << 12));
 	res->_len = len;
@@ -226,6 +360,7 @@ public:
 
     // we could not alloc the memory region directly from RAM, thus we use our own buffer instead.
     {
+      _mmio = true;
       assert(len <= BUFFER_SIZE);
       search_entry(_buffers, _newest_buffer);
 
@@ -255,6 +390,17 @@ public:
       _buffers[entry]._phys1 = phys1;
       _buffers[entry]._phys2 = phys2;
 
+      /**
+       * A LOCKed read-modify-write on a buffer is atomic, if nobody
+       * touches the operand between the read and the writeback.  We
+       * keep the device lock and the bus lock until invalidate().
+       */
+      if (_lock_operand && !_bus_locked) {
+	device_lock(true);
+	bus_lock().enter_exclusive();
+	_bus_locked = true;
+      }
+
       // do we have to read the data into the cache?
       if (type & TYPE_R) buffer_io(true, entry);
 
@@ -273,10 +419,12 @@ public:
       else
 	_oldest_write = _newest_write = ~0;
       for (unsigned i=0; i < BUFFERS; i++) { _buffers[i]._ptr = 0; _buffers[i]._newer_write = ~0; }
+      stored();
+      bus_unlock();
     }
 
 
-  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets()
+  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion, DBus<MessageHostOp> &hostop) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), _mmio(), _hostop(hostop), _unlocked(), _lock_operand(), _bus_locked(), _write_count(), debug(false), _sets()
   {
     assert(ASSOZ   >= 2);
     assert(BUFFERS >= 2);
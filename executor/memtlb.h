@@ -22,17 +22,52 @@
 
 /**
  * A TLB implementation relying on the cache.
+ *
+ * Translations are kept in two set-associative arrays, one for code
+ * fetches and one for data accesses.  Large pages are split into 4k
+ * entries.  Entries are only dropped on CR3 writes, paging mode
+ * changes and INVLPG - as on real hardware a guest has to flush
+ * after modifying its pagetables.
  */
 class MemTlb : public MemCache
 {
 protected:
   CpuState *_cpu;
 
+  enum {
+    TLB_SIZE  = 64,
+    TLB_ASSOZ = 4,
+  };
+
+  struct TlbEntry
+  {
+    // the 4k aligned linear and physical address
+    uintptr_t _virt;
+    uintptr_t _phys;
+    // a direct pointer to the page if it is RAM, 0 otherwise
+    char *_ptr;
+    // TYPE_* rights of this mapping, 0 -> invalid
+    unsigned _rights;
+    // log2 of the size of the page this entry was split from
+    unsigned _shift;
+    bool _global;
+  };
+
 private:
   // pdpt cache for 32-bit PAE
   unsigned long long _pdpt[4];
   unsigned long _msr_efer;
   unsigned _paging_mode;
+  // the cr3 the entries belong to
+  uintptr_t _tlb_cr3;
+  bool _tlb_valid;
+  // cr3 was written since the last init()
+  bool _tlb_cr3_dirty;
+  unsigned _tlb_pos;
+  // do we have entries split from large pages?
+  bool _tlb_large;
+  TlbEntry _itlb[TLB_SIZE * TLB_ASSOZ];
+  TlbEntry _dtlb[TLB_SIZE * TLB_ASSOZ];
 
   enum Features {
     FEATURE_PSE        = 1 << 0,
@@ -41,7 +76,7 @@ private:
     FEATURE_SMALL_PDPT = 1 << 3,
     FEATURE_LONG       = 1 << 4,
   };
-  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys);
+  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, TlbEntry &fill);
 
 #define AD_ASSIST(bits)							\
   if ((pte & (bits)) != (bits))						\
@@ -51,15 +86,19 @@ private:
     }									\
     else								\
       if (Cpu::cmpxchg4b(entry->_ptr, pte, pte | bits) != pte) RETRY;	\
+    CodeGeneration::modified(entry->_phys1, sizeof(pte));		\
     }
 
   template <unsigned features, typename PTE_TYPE>
-    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys)
-  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, phys); }
+    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, TlbEntry &fill)
+  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, fill); }
 
 
+  /**
+   * Walk the pagetables and return the translation in fill.
+   */
   template <unsigned features, typename PTE_TYPE>
-    unsigned tlb_fill2(uintptr_t virt, unsigned type, uintptr_t &phys)
+    unsigned tlb_fill2(uintptr_t virt, unsigned type, TlbEntry &fill)
   {
     PTE_TYPE pte;
     if (features & FEATURE_SMALL_PDPT) pte = _pdpt[(virt >> 30) & 3]; else pte = READ(cr3);
@@ -107,18 +146,80 @@ private:
     AD_ASSIST((rights & 3) << 5);
 
     unsigned size = ((features & FEATURE_PAE) ? 9 : 10) * l + 12;
+    uintptr_t phys;
     if (features & FEATURE_PSE36 && is_sp)
       phys = ((pte >> 22) | ((pte & 0x1fe000) >> 2));
     else
       phys = pte >> size;
     phys = (phys << size) | (virt & ((1 << size) - 1));
+
+    fill._virt   = virt & ~0xffful;
+    fill._phys   = phys & ~0xffful;
+    fill._rights = rights;
+    fill._shift  = size;
+    fill._global = pte & 0x100 && _paging_mode & 0x80;
     return _fault;
   }
 
-  int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys) {
 
-    if (tlb_fill_func) return tlb_fill_func(this, virt, type, phys);
-    phys = virt;
+  unsigned tlb_slot(uintptr_t virt) { unsigned page = virt >> 12; return ((page ^ (page / TLB_SIZE)) % TLB_SIZE) * TLB_ASSOZ; }
+
+
+  /**
+   * Find the entry for the page of virt.
+   */
+  TlbEntry *tlb_lookup(uintptr_t virt, Type type)
+  {
+    TlbEntry *tlb = (type & TYPE_X) ? _itlb : _dtlb;
+    uintptr_t page = virt & ~0xffful;
+    for (unsigned i = tlb_slot(virt); i < tlb_slot(virt) + TLB_ASSOZ; i++)
+      if (tlb[i]._rights && tlb[i]._virt == page) return tlb + i;
+    return 0;
+  }
+
+
+  /**
+   * Put a new translation into the TLB.
+   */
+  TlbEntry *tlb_insert(TlbEntry &fill, Type type)
+  {
+    TlbEntry *entry = tlb_lookup(fill._virt, type);
+    if (!entry) {
+      TlbEntry *tlb = (type & TYPE_X) ? _itlb : _dtlb;
+      entry = tlb + tlb_slot(fill._virt) + (_tlb_pos++ % TLB_ASSOZ);
+    }
+    *entry = fill;
+    if (fill._shift > 12) _tlb_large = true;
+
+    // try to get a direct memory reference
+    MessageMemRegion msg(fill._phys >> 12);
+    entry->_ptr = 0;
+    if (memregion(msg) && msg.ptr)
+      entry->_ptr = msg.ptr + (fill._phys - (msg.start_page << 12));
+    return entry;
+  }
+
+
+  int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys, TlbEntry **result = 0) {
+
+    if (result) *result = 0;
+    TlbEntry *entry = tlb_lookup(virt, type);
+    if (!entry || (entry->_rights & type) != type) {
+      TlbEntry fill;
+      if (tlb_fill_func) {
+	if (tlb_fill_func(this, virt, type, fill)) return _fault;
+      }
+      else {
+	// no paging: an identity mapping with all rights
+	fill._virt   = fill._phys = virt & ~0xffful;
+	fill._rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
+	fill._shift  = 12;
+	fill._global = false;
+      }
+      entry = tlb_insert(fill, type);
+    }
+    if (result) *result = entry;
+    phys = entry->_phys | (virt & 0xfff);
     return _fault;
   }
 
@@ -138,15 +239,62 @@ private:
   }
 
 protected:
+  // set on every store to guest memory, cleared by the spin detection
+  bool _stored;
+
   Type user_access(Type type) {
     if (_cpu->cpl() == 3) return Type(TYPE_U | type);
     return type;
   }
 
 
+  /**
+   * Drop all TLB entries. Global ones survive if requested.
+   */
+  void tlb_flush(bool keep_global) {
+    for (unsigned i=0; i < TLB_SIZE * TLB_ASSOZ; i++) {
+      if (!keep_global || !_itlb[i]._global) _itlb[i]._rights = 0;
+      if (!keep_global || !_dtlb[i]._global) _dtlb[i]._rights = 0;
+    }
+    if (!keep_global) _tlb_large = false;
+  }
+
+
+  /**
+   * Drop the entries that translate virt. Entries split from a large
+   * page are dropped together.
+   */
+  void tlb_flush_page(uintptr_t virt) {
+    for (unsigned i = tlb_slot(virt); i < tlb_slot(virt) + TLB_ASSOZ; i++) {
+      if (_itlb[i]._virt == (virt & ~0xffful)) _itlb[i]._rights = 0;
+      if (_dtlb[i]._virt == (virt & ~0xffful)) _dtlb[i]._rights = 0;
+    }
+    if (_tlb_large)
+      for (unsigned i=0; i < TLB_SIZE * TLB_ASSOZ; i++) {
+	if (!((_itlb[i]._virt ^ virt) >> _itlb[i]._shift)) _itlb[i]._rights = 0;
+	if (!((_dtlb[i]._virt ^ virt) >> _dtlb[i]._shift)) _dtlb[i]._rights = 0;
+      }
+  }
+
+
+  /**
+   * A write to CR3 flushes the TLB on the next init(), even if the
+   * value has not changed.
+   */
+  void tlb_cr3_write() { _tlb_cr3_dirty = true; }
+
+
   int init() {
 
-    _paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00;
+    // the TLB stays valid as long as cr3 and the paging mode are the same
+    unsigned paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0xb0 | _msr_efer & 0xc00;
+    if (_tlb_valid && !_tlb_cr3_dirty && paging_mode == _paging_mode && READ(cr3) == _tlb_cr3)  return _fault;
+
+    // global entries survive if only cr3 has changed
+    tlb_flush(_tlb_valid && paging_mode == _paging_mode);
+    _tlb_valid = false;
+    _tlb_cr3_dirty = false;
+    _paging_mode = paging_mode;
 
     // fetch pdpts in leagacy PAE mode
     if ((_paging_mode & 0x80000420) == 0x80000020)
@@ -173,6 +321,8 @@ protected:
 	      tlb_fill_func = &tlb_fill<FEATURE_PSE | FEATURE_PAE | FEATURE_LONG, unsigned long long>;
 	  }
       }
+    _tlb_cr3 = READ(cr3);
+    _tlb_valid = true;
     return _fault;
   }
 
@@ -183,6 +333,17 @@ protected:
   int read_code(uintptr_t virt, size_t len, void *buffer)
   {
     assert(len < 16);
+
+    // fast path: the bytes are in a single RAM page
+    TlbEntry *tlb;
+    uintptr_t phys;
+    if (!((virt ^ (virt + len - 1)) & ~0xffful)) {
+      if (virt_to_phys(virt, user_access(Type(TYPE_X | TYPE_R)), phys, &tlb)) return _fault;
+      if (tlb && tlb->_ptr) {
+	memcpy(buffer, tlb->_ptr + (virt & 0xfff), len);
+	return _fault;
+      }
+    }
     CacheEntry *entry = find_virtual(virt & ~3, (len + (virt & 3) + 3) & ~3ul, user_access(Type(TYPE_X | TYPE_R)));
     if (entry) {
       assert(len <= entry->_len);
@@ -195,8 +356,44 @@ protected:
   }
 
 
+  /**
+   * Translate a code address to a physical one.
+   */
+  int code_phys(uintptr_t virt, uintptr_t &phys)
+  {
+    return virt_to_phys(virt, user_access(Type(TYPE_X | TYPE_R)), phys);
+  }
+
+
+  /**
+   * Get a host pointer to the RAM page behind virt.  Returns zero on a
+   * fault or if the page is not RAM.
+   */
+  char *virt_to_host(uintptr_t virt, Type type, uintptr_t &phys)
+  {
+    TlbEntry *tlb;
+    if (virt_to_phys(virt, type, phys, &tlb) || !tlb || !tlb->_ptr) return 0;
+    if (type & TYPE_W) _stored = true;
+    return tlb->_ptr + (virt & 0xfff);
+  }
+
+
   int prepare_virtual(uintptr_t virt, size_t len, Type type, void *&ptr)
   {
+    if (type & TYPE_W) _stored = true;
+
+    // fast path: a single RAM page
+    TlbEntry *tlb;
+    uintptr_t phys;
+    if (!((virt ^ (virt + len - 1)) & ~0xffful)) {
+      if (virt_to_phys(virt, type, phys, &tlb)) return _fault;
+      if (tlb && tlb->_ptr) {
+	if (type & TYPE_W) will_store(phys, len);
+	ptr = tlb->_ptr + (virt & 0xfff);
+	return _fault;
+      }
+    }
+
     bool round = (virt | len) & 3;
     CacheEntry *entry = find_virtual(virt & ~3ul, (len + (virt & 3) + 3) & ~3ul, round ? Type(type | TYPE_R) : type);
     if (entry) {
@@ -207,5 +404,6 @@ protected:
   }
 
 
-  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), tlb_fill_func() {}
+  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion, DBus<MessageHostOp> &hostop)
+    : MemCache(mem, memregion, hostop), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), _tlb_cr3(), _tlb_valid(), _tlb_cr3_dirty(), _tlb_pos(), _tlb_large(), _itlb(), _dtlb(), tlb_fill_func(), _stored() {}
 };
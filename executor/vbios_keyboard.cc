@@ -227,10 +227,13 @@ public:
       case MessageHostOp::OP_VCPU_CREATE_BACKEND:
       case MessageHostOp::OP_VCPU_BLOCK:
       case MessageHostOp::OP_VCPU_RELEASE:
+      case MessageHostOp::OP_VCPU_YIELD:
       case MessageHostOp::OP_ALLOC_SEMAPHORE:
       case MessageHostOp::OP_ALLOC_SERVICE_THREAD:
       case MessageHostOp::OP_ALLOC_SERVICE_PORTAL:
       case MessageHostOp::OP_WAIT_CHILD:
+      case MessageHostOp::OP_DEVICE_LOCK:
+      case MessageHostOp::OP_DEVICE_UNLOCK:
       default:
         Logging::panic("%s - unimplemented operation %x", __PRETTY_FUNCTION__, msg.type);
       }
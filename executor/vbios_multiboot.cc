@@ -138,6 +138,8 @@ private:
 	  }
       }
 
+    // the modules were copied directly into the guest memory
+    CodeGeneration::modified_all();
     if (!m) return 0;
 
     // provide memory map
@@ -153,6 +155,8 @@ private:
     m->mmap_length = sizeof(mymap);
     m->flags |= MBI_FLAG_MMAP | MBI_FLAG_MEM;
     memcpy(physmem + m->mmap_addr, mymap, m->mmap_length);
+    // the MBI and the memory map were written after the bump above
+    CodeGeneration::modified(mbi, m->mmap_addr + m->mmap_length - mbi);
 
     return mbi;
   };
@@ -151,13 +151,29 @@ class VirtualBiosReset : public StaticReceiver<VirtualBiosReset>, public BiosCom
 
 
 
+  /**
+   * Write into the low memory.  The generation of the written pages
+   * is bumped after the store, so that no decoded instruction is
+   * revalidated against the old bytes.
+   */
+  void mem_write(size_t offset, const void *src, size_t len) {
+    memcpy(_mem_ptr + offset, src, len);
+    CodeGeneration::modified(offset, len);
+  }
+
+  void mem_clear(size_t offset, size_t len) {
+    memset(_mem_ptr + offset, 0, len);
+    CodeGeneration::modified(offset, len);
+  }
+
+
   size_t alloc(size_t size, size_t alignment) {
     if ((size + alignment + 0x1000) > _mem_size) return 0;
     _mem_size -= size;
     _mem_size &= ~alignment;
 
     // clear region
-    memset(_mem_ptr + _mem_size, 0, size);
+    mem_clear(_mem_size, size);
     return _mem_size;
   }
 
@@ -179,7 +195,8 @@ class VirtualBiosReset : public StaticReceiver<VirtualBiosReset>, public BiosCom
     char value = 0;
     for (size_t i=0; i < length && i < r->length; i++)
       value += _mem_ptr[r->offset + i];
-    _mem_ptr[r->offset + chksum_offset] -= value;
+    char chksum = _mem_ptr[r->offset + chksum_offset] - value;
+    mem_write(r->offset + chksum_offset, &chksum, 1);
   }
 
 
@@ -197,11 +214,11 @@ class VirtualBiosReset : public StaticReceiver<VirtualBiosReset>, public BiosCom
   bool create_resource(unsigned index, const char *name) {
     if (!strcmp("realmode idt", name)) {
       _resources[index] = Resource(name, 0, 0x400, false);
-      memset(_mem_ptr + _resources[index].offset, 0, _resources[index].length);
+      mem_clear(_resources[index].offset, _resources[index].length);
     }
     else if (!strcmp("bda", name)) {
       _resources[index] = Resource(name, 0x400, 0x200, false);
-      memset(_mem_ptr + _resources[index].offset, 0, _resources[index].length);
+      mem_clear(_resources[index].offset, _resources[index].length);
     }
     else if (!strcmp("ebda", name)) {
       size_t ebda;
@@ -278,7 +295,7 @@ public:
           discovery_write_dw(r->name, 4, needed_len, 4);
           table_len = needed_len;
         }
-        memcpy(_mem_ptr + r->offset + msg.offset, msg.data, msg.count);
+        mem_write(r->offset + msg.offset, msg.data, msg.count);
 
         // and fix the checksum
         if (r->acpi_table)   fix_acpi_checksum(r, table_len);
@@ -171,6 +171,11 @@ public:
 	_cpu.actv_state = 0x80000000;
       case MessageHostOp::OP_VCPU_CREATE_BACKEND:
 	return true;
+      case MessageHostOp::OP_VCPU_YIELD:
+      case MessageHostOp::OP_DEVICE_LOCK:
+      case MessageHostOp::OP_DEVICE_UNLOCK:
+	// the BIOS runs synchronously under our own lock
+	return false;
       case MessageHostOp::OP_VCPU_RELEASE:
       case MessageHostOp::OP_NOTIFY_IRQ:
       case MessageHostOp::OP_GET_MODULE:
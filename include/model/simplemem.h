@@ -16,8 +16,8 @@
  * General Public License version 2 for more details.
  */
 
-DBus<MessageMemRegion>  *_bus_memregion;
-DBus<MessageMem>        *_bus_mem;
+DBusMem<MessageMemRegion> *_bus_memregion;
+DBusMem<MessageMem>       *_bus_mem;
 
 
 /**
@@ -29,8 +29,10 @@ bool copy_inout(uintptr_t address, void *ptr, size_t count, bool read)
   if (!_bus_memregion->send(msg) || !msg.ptr || ((address + count) > ((msg.start_page + msg.count) << 12))) return false;
   if (read)
     memcpy(ptr, msg.ptr + (address - (msg.start_page << 12)), count);
-  else
+  else {
     memcpy(msg.ptr + (address - (msg.start_page << 12)), ptr, count);
+    CodeGeneration::modified(address, count);
+  }
   return true;
 }
 
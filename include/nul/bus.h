@@ -88,6 +88,19 @@ public:
     return res;
   }
 
+  /**
+   * Send message LIFO, but skip the given receiver.
+   */
+  bool  send_except(M &msg, bool earlyout, Device *dev, ReceiveFunction func)
+  {
+    _debug_counter++;
+    bool res = false;
+    for (unsigned i = _list_count; i-- && !(earlyout && res);)
+      if (_list[i]._dev != dev || _list[i]._func != func)
+	res |= _list[i]._func(_list[i]._dev, msg);
+    return res;
+  }
+
   /**
    * Send message in FIFO order
    */
@@ -140,3 +153,274 @@ public:
   /** Default constructor. */
   DBus() : _debug_counter(0), _list_count(0), _list_size(0), _list(nullptr) {}
 };
+
+
+/**
+ * An I/O port bus.  Devices with fixed ports claim them, so that an
+ * access is directly delivered to its owner instead of asking every
+ * device on the bus.  Accesses to unclaimed ports, to ports claimed
+ * by more than one device, or spanning ports of different owners are
+ * broadcasted as before.  So are accesses the owner declines, thus a
+ * device that claims too many ports does not hide the others.  The
+ * owner is not asked twice.  An access the owner accepts still
+ * reaches the devices that did not claim any ports, unless the
+ * sender wants only the first hit.
+ *
+ * A message with a count moves count elements from or to ptr at once.
+ * Only devices added with add_block() see them.  They decrement the
+ * count by the elements they have moved and advance ptr, such that
+ * the sender can do the rest element by element.
+ */
+template <class M>
+class DBusIO : public DBus<M>
+{
+  typedef bool (*ReceiveFunction)(Device *, M&);
+  enum {
+    PORTS  = 1 << 16,
+    SHARED = 0xff,
+  };
+  struct Owner
+  {
+    Device *_dev;
+    ReceiveFunction _func;
+  } _owners[SHARED - 1];
+  unsigned _owner_count;
+  unsigned _unclaimed;
+  unsigned char *_ports;
+  DBus<M> _block;
+
+  unsigned find_owner(Device *dev, ReceiveFunction func)
+  {
+    for (unsigned i = 0; i < _owner_count; i++)
+      if (_owners[i]._dev == dev && _owners[i]._func == func)  return i + 1;
+    if (_owner_count >= SHARED - 1)  return SHARED;
+    _owners[_owner_count]._dev  = dev;
+    _owners[_owner_count]._func = func;
+    return ++_owner_count;
+  }
+public:
+
+  /**
+   * Add a device that may answer any port.
+   */
+  void add(Device *dev, ReceiveFunction func)
+  {
+    DBus<M>::add(dev, func);
+    _unclaimed++;
+  }
+
+
+  /**
+   * Claim a port range for a device without adding it to the
+   * broadcast list.
+   */
+  void claim(Device *dev, ReceiveFunction func, unsigned long base, unsigned long count)
+  {
+    if (base >= PORTS || count > PORTS - base)  return;
+    if (!_ports) {
+      _ports = new unsigned char[PORTS];
+      memset(_ports, 0, PORTS);
+    }
+    unsigned char owner = find_owner(dev, func);
+    for (unsigned long port = base; port < base + count; port++)
+      _ports[port] = (!_ports[port] || _ports[port] == owner) ? owner : static_cast<unsigned char>(SHARED);
+  }
+
+
+  /**
+   * Add a device that answers a fixed port range.
+   */
+  void add(Device *dev, ReceiveFunction func, unsigned long base, unsigned long count)
+  {
+    DBus<M>::add(dev, func);
+    claim(dev, func, base, count);
+  }
+
+
+  /**
+   * Add a device that also understands counted messages.
+   */
+  void add_block(Device *dev, ReceiveFunction func)
+  {
+    add(dev, func);
+    _block.add(dev, func);
+  }
+
+
+  /**
+   * Send a message to the owner of the port or to everybody.
+   */
+  bool  send(M &msg, bool earlyout = false)
+  {
+    if (msg.count)  return _block.send(msg, true);
+    if (_ports) {
+      unsigned port  = msg.port;
+      unsigned owner = _ports[port];
+      for (unsigned i = 1; i < (1u << msg.type) && owner && owner != SHARED; i++)
+	if (port + i >= PORTS || _ports[port + i] != owner)  owner = SHARED;
+      if (owner && owner != SHARED) {
+	Owner &o = _owners[owner - 1];
+	bool res = o._func(o._dev, msg);
+	if (res && (earlyout || !_unclaimed))  return true;
+	return DBus<M>::send_except(msg, earlyout, o._dev, o._func) || res;
+      }
+    }
+    return DBus<M>::send(msg, earlyout);
+  }
+
+  DBusIO() : _owner_count(0), _unclaimed(0), _ports(nullptr) {}
+};
+
+
+/**
+ * A memory bus.  Devices claim the physical address ranges they
+ * handle, which are kept in a sorted list of disjoint segments, such
+ * that a message finds its owner by a binary search instead of asking
+ * every device on the bus.  If the owner declines, the address is
+ * claimed by several devices or not at all, the message is
+ * broadcasted as before.
+ *
+ * The message has to provide its physical address via address().
+ */
+template <class M>
+class DBusMem : public DBus<M>
+{
+  typedef bool (*ReceiveFunction)(Device *, M&);
+  enum { SHARED = ~0u };
+  struct Claim
+  {
+    Device *_dev;
+    ReceiveFunction _func;
+    unsigned long _start;
+    unsigned long _last;
+  };
+  struct Segment
+  {
+    unsigned long _start;
+    unsigned long _last;
+    unsigned _claim;
+  };
+  unsigned _claim_count;
+  unsigned _claim_size;
+  Claim   *_claims;
+  unsigned _segment_count;
+  Segment *_segments;
+
+
+  /**
+   * Split the claims into disjoint segments.  This is only done on
+   * registration, thus a simple quadratic algorithm is sufficient.
+   */
+  void rebuild()
+  {
+    unsigned long *bounds = new unsigned long[2 * _claim_count];
+    unsigned count = 0;
+    for (unsigned i = 0; i < _claim_count; i++) {
+      bounds[count++] = _claims[i]._start;
+      if (_claims[i]._last != ~0ul)  bounds[count++] = _claims[i]._last + 1;
+    }
+    for (unsigned i = 1; i < count; i++)
+      for (unsigned j = i; j && bounds[j - 1] > bounds[j]; j--) {
+	unsigned long t = bounds[j];
+	bounds[j] = bounds[j - 1];
+	bounds[j - 1] = t;
+      }
+
+    if (_segments) delete [] _segments;
+    _segments = new Segment[count];
+    _segment_count = 0;
+    for (unsigned i = 0; i < count; i++) {
+      if (i && bounds[i] == bounds[i - 1]) continue;
+      unsigned long start = bounds[i];
+      unsigned long last  = i + 1 < count ? bounds[i + 1] - 1 : ~0ul;
+      for (unsigned j = i + 1; j < count && bounds[j] == start; j++)
+	last = j + 1 < count ? bounds[j + 1] - 1 : ~0ul;
+
+      unsigned owner = SHARED;
+      bool found = false;
+      for (unsigned j = 0; j < _claim_count; j++) {
+	Claim &c = _claims[j];
+	if (c._start > start || c._last < start) continue;
+	if (!found)
+	  owner = j;
+	else if (owner == SHARED || c._dev != _claims[owner]._dev || c._func != _claims[owner]._func)
+	  owner = SHARED;
+	found = true;
+      }
+      if (!found) continue;
+
+      Segment *prev = _segment_count ? _segments + _segment_count - 1 : 0;
+      if (prev && prev->_claim == owner && prev->_last + 1 == start)
+	prev->_last = last;
+      else {
+	_segments[_segment_count]._start = start;
+	_segments[_segment_count]._last  = last;
+	_segments[_segment_count]._claim = owner;
+	_segment_count++;
+      }
+    }
+    delete [] bounds;
+  }
+
+
+  Segment *lookup(unsigned long address)
+  {
+    unsigned lo = 0, hi = _segment_count;
+    while (lo < hi) {
+      unsigned mid = (lo + hi) / 2;
+      if (_segments[mid]._start <= address) lo = mid + 1; else hi = mid;
+    }
+    if (!lo || _segments[lo - 1]._last < address) return 0;
+    return _segments + lo - 1;
+  }
+public:
+  using DBus<M>::add;
+
+  /**
+   * Claim a physical address range for a device without adding it to
+   * the broadcast list.
+   */
+  void claim(Device *dev, ReceiveFunction func, unsigned long start, unsigned long size)
+  {
+    if (!size) return;
+    if (_claim_count >= _claim_size) {
+      Claim *n = new Claim[_claim_size ? _claim_size * 2 : 4];
+      memcpy(n, _claims, _claim_count * sizeof(*_claims));
+      if (_claims) delete [] _claims;
+      _claims = n;
+      _claim_size = _claim_size ? _claim_size * 2 : 4;
+    }
+    Claim &c = _claims[_claim_count++];
+    c._dev   = dev;
+    c._func  = func;
+    c._start = start;
+    c._last  = start + size - 1 < start ? ~0ul : start + size - 1;
+    rebuild();
+  }
+
+
+  /**
+   * Add a device that handles a fixed physical address range.
+   */
+  void add(Device *dev, ReceiveFunction func, unsigned long start, unsigned long size)
+  {
+    add(dev, func);
+    claim(dev, func, start, size);
+  }
+
+
+  /**
+   * Send a message to the owner of the address or to everybody.
+   */
+  bool  send(M &msg, bool earlyout = false)
+  {
+    Segment *s = lookup(msg.address());
+    if (s && s->_claim != SHARED) {
+      Claim &c = _claims[s->_claim];
+      if (c._func(c._dev, msg)) return true;
+    }
+    return DBus<M>::send(msg, earlyout);
+  }
+
+  DBusMem() : _claim_count(0), _claim_size(0), _claims(nullptr), _segment_count(0), _segments(nullptr) {}
+};
@@ -0,0 +1,58 @@
+/** @file
+ * Generation counters for guest-physical pages.
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+#include "service/cpu.h"
+
+/**
+ * Everybody that writes to guest memory bumps the generation of the
+ * written pages.  Instruction emulators remember the generation of
+ * the page they decoded an instruction from, so that a cache hit is
+ * a simple compare instead of a reread of the code.
+ *
+ * The pages are hashed into a fixed table, thus a collision only
+ * leads to a spurious invalidation.
+ */
+class CodeGeneration
+{
+  enum { SIZE = 4096 };
+  static volatile unsigned *table() { static volatile unsigned gen[SIZE + 1]; return gen; }
+
+public:
+
+  /**
+   * Returns the current generation of a page.  The last slot is a
+   * global generation that is added to all of them.
+   */
+  static unsigned get(uintptr_t page) { return table()[page % SIZE] + table()[SIZE]; }
+
+
+  /**
+   * Bump the generation of all pages in the given range.
+   */
+  static void modified(uintptr_t phys, size_t len)
+  {
+    if (!len) return;
+    uintptr_t last = (phys + len - 1) >> 12;
+    if (last - (phys >> 12) >= SIZE) return modified_all();
+    for (uintptr_t page = phys >> 12; page <= last; page++)
+      Cpu::atomic_xadd(table() + page % SIZE, 1);
+  }
+
+
+  /**
+   * Bump the generation of the whole guest memory.
+   */
+  static void modified_all() { Cpu::atomic_xadd(table() + SIZE, 1); }
+};
@@ -95,6 +95,7 @@ struct MessageMem
   uintptr_t phys;
   unsigned *ptr;
   MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr) : read(_read), phys(_phys), ptr(_ptr) {}
+  uintptr_t address() const { return phys; }
 };
 
 /**
@@ -111,6 +112,7 @@ struct MessageMemRegion
   unsigned      count;
   char *        ptr;
   MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0) {}
+  uintptr_t address() const { return page << 12; }
 };
 
 
@@ -448,7 +450,10 @@ struct MessageHostOp
       OP_VCPU_CREATE_BACKEND,
       OP_VCPU_BLOCK,
       OP_VCPU_RELEASE,
+      OP_VCPU_YIELD,
       OP_WAIT_CHILD,
+      OP_DEVICE_LOCK,
+      OP_DEVICE_UNLOCK,
     } type;
   union {
     unsigned long value;
@@ -22,6 +22,7 @@
 #include "service/profile.h"
 #include "service/string.h"
 #include "bus.h"
+#include "codegen.h"
 #include "message.h"
 #include "timer.h"
 #include "templates.h"
@@ -57,16 +58,16 @@ class Motherboard
   DBus<MessageDiskCommit>   bus_diskcommit;
   DBus<MessageHostOp>       bus_hostop;
   DBus<MessageHwIOIn>       bus_hwioin;	    ///< HW I/O space reads
-  DBus<MessageIOIn>         bus_ioin;       ///< I/O space reads from virtual machines
+  DBusIO<MessageIOIn>       bus_ioin;       ///< I/O space reads from virtual machines
   DBus<MessageHwIOOut>      bus_hwioout;    ///< HW I/O space writes
-  DBus<MessageIOOut>        bus_ioout;	    ///< I/O space writes from virtual machines
+  DBusIO<MessageIOOut>      bus_ioout;	    ///< I/O space writes from virtual machines
   DBus<MessageInput>        bus_input;
   DBus<MessageIrq>          bus_hostirq;    ///< Host IRQs
   DBus<MessageIrqLines>	    bus_irqlines;   ///< Virtual IRQs before they reach (virtual) IRQ controller
   DBus<MessageIrqNotify>    bus_irqnotify;
   DBus<MessageLegacy>       bus_legacy;
-  DBus<MessageMem>          bus_mem;	    ///< Access to memory from virtual devices
-  DBus<MessageMemRegion>    bus_memregion;  ///< Access to memory pages from virtual devices
+  DBusMem<MessageMem>       bus_mem;	    ///< Access to memory from virtual devices
+  DBusMem<MessageMemRegion> bus_memregion;  ///< Access to memory pages from virtual devices
   DBus<MessageNetwork>      bus_network;
   DBus<MessagePS2>          bus_ps2;
   DBus<MessageHwPciConfig>  bus_hwpcicfg;   ///< Access to real HW PCI configuration space
@@ -18,6 +18,7 @@
 #pragma once
 #include "service/cpu.h"
 #include "service/math.h"
+#include "service/string.h"
 
 
 typedef unsigned long long timevalue;
@@ -25,28 +26,72 @@ typedef unsigned long long timevalue;
 /**
  * A clock returns the time in different time domains.
  *
- * The reference clock is the CPUs TSC.
+ * The reference clock is the CPUs TSC, unless the frontend provides
+ * another source.
  */
 class Clock
 {
+ public:
+  /**
+   * A precomputed conversion: value * to / from as a multiply and a shift.
+   */
+  struct Scale
+  {
+    uint64   mult;
+    unsigned shift;
+
+    timevalue apply(timevalue value) const { return Math::mulshift(value, mult, shift); }
+
+    Scale(timevalue to, timevalue from) {
+      // the largest shift where the multiplier stays below 2^63
+      int s = 62 + (63 - __builtin_clzll(from)) - (63 - __builtin_clzll(to));
+      shift = s < 0 ? 0 : (s > 63 ? 63 : s);
+      mult  = Math::shiftdiv(to, shift, from);
+    }
+  };
+
+  /**
+   * The conversions from and to a frequency domain, which a model
+   * computes once for its hot paths.
+   */
+  struct Domain
+  {
+    Scale to;    ///< clock ticks to domain ticks
+    Scale from;  ///< domain ticks to clock ticks
+    Domain(timevalue freq, timevalue source_freq) : to(freq, source_freq), from(source_freq, freq) {}
+  };
+
  protected:
   timevalue _source_freq;
+  // the time source, the TSC if not set
+  timevalue (*_source)();
  public:
 #ifdef TESTING
   virtual
 #endif
-  timevalue time() { return Cpu::rdtsc(); }
+  timevalue time() { return _source ? _source() : Cpu::rdtsc(); }
 
   /**
    * Returns the current clock in freq-time.
    */
   timevalue clock(timevalue freq, timevalue t_cur = 0) { return Math::muldiv128(t_cur == 0 ? time() : t_cur, freq, _source_freq); }
+  timevalue clock(const Domain &domain, timevalue t_cur = 0) { return domain.to.apply(t_cur == 0 ? time() : t_cur); }
 
   /**
    * Frequency of the clock.
    */
   timevalue freq() { return _source_freq; }
 
+  /**
+   * Whether the clock counts in host TSC ticks.
+   */
+  bool is_tsc() { return !_source; }
+
+  /**
+   * Precompute the conversions for the given frequency.
+   */
+  Domain domain(timevalue freq) { return Domain(freq, _source_freq); }
+
   /**
    * Returns a timeout in absolute TSC time.
    * @param thedelta The timeout
@@ -57,6 +102,7 @@ class Clock
    * Example: abstime(5, 1000) returns the time of now plus 5 milliseconds.
    */
   timevalue abstime(timevalue thedelta, timevalue freq) {  return time() + Math::muldiv128(thedelta, _source_freq, freq); }
+  timevalue abstime(timevalue thedelta, const Domain &domain) {  return time() + domain.from.apply(thedelta); }
 
 
   /**
@@ -68,7 +114,94 @@ class Clock
     return Math::muldiv128(theabstime - now, freq, _source_freq);
   }
 
-  Clock(timevalue source_freq) : _source_freq(source_freq) {}
+  timevalue delta(timevalue theabstime, const Domain &domain) {
+    timevalue now = time();
+    if (now > theabstime) return 0;
+    return domain.to.apply(theabstime - now);
+  }
+
+  Clock(timevalue source_freq, timevalue (*source)() = 0) : _source_freq(source_freq), _source(source) {}
+};
+
+
+/**
+ * Lost-tick accounting for a periodic timer source.
+ *
+ * The ticks are not counted by the timeouts but computed lazily from
+ * the clock: the model passes the number of periods elapsed since
+ * some fixed point whenever it looks at the source.  Ticks that
+ * elapsed while the guest had not acknowledged the previous one are
+ * dropped (COALESCE), delivered at a faster rate (SLEW) or delivered
+ * back-to-back (REPLAY).  At most MAX_BACKLOG ticks are kept.
+ */
+class TickCatchup
+{
+public:
+  enum Policy
+  {
+    COALESCE,
+    SLEW,
+    REPLAY,
+  };
+  enum
+  {
+    MAX_BACKLOG = 1024,
+    // slewed ticks come at four times the rate
+    SLEW_SHIFT  = 2,
+  };
+private:
+  Policy    _policy;
+  timevalue _delivered;
+public:
+  /**
+   * Restart the accounting, no tick is pending.
+   */
+  void reset(timevalue elapsed = 0) { _delivered = elapsed; }
+
+  /**
+   * The number of ticks that are not delivered yet.
+   */
+  timevalue pending(timevalue elapsed) const { return elapsed > _delivered ? elapsed - _delivered : 0; }
+
+  /**
+   * The previous tick is not acknowledged yet, thus the elapsed
+   * ticks can not be delivered now.
+   */
+  void skip(timevalue elapsed)
+  {
+    if (_policy == COALESCE)  _delivered = elapsed;
+    else if (pending(elapsed) > MAX_BACKLOG)  _delivered = elapsed - MAX_BACKLOG;
+  }
+
+  /**
+   * Deliver a tick.  Returns false if none is pending.
+   */
+  bool deliver(timevalue elapsed)
+  {
+    if (!pending(elapsed))  return false;
+    skip(elapsed);
+    if (_policy != COALESCE)  _delivered++;
+    return true;
+  }
+
+  /**
+   * Returns the delay until the next tick should be delivered, given
+   * the time to the next period boundary.
+   */
+  timevalue delay(timevalue elapsed, timevalue remaining, timevalue period) const
+  {
+    if (_policy == COALESCE || !pending(elapsed))  return remaining;
+    if (_policy == REPLAY) return 1;
+    timevalue slewed = period >> SLEW_SHIFT;
+    return (slewed && slewed < remaining) ? slewed : remaining;
+  }
+
+  /**
+   * Convert a commandline parameter, that may be missing.
+   */
+  static Policy policy(unsigned long value) { return (value == SLEW || value == REPLAY) ? Policy(value) : COALESCE; }
+
+  TickCatchup(Policy policy = COALESCE) : _policy(policy), _delivered(0) {}
 };
 
 
@@ -76,6 +209,10 @@ class Clock
 
 /**
  * Keeping track of the timeouts.
+ *
+ * The programmed timeouts are kept in a binary min-heap, so a request
+ * or cancel is O(log n) and the next timeout is found in O(1).  The
+ * table starts with ENTRIES timers and doubles when they are used up.
  */
 template <unsigned ENTRIES, typename DATA>
 class TimeoutList
@@ -83,14 +220,60 @@ class TimeoutList
   class TimeoutEntry
   {
     friend class TimeoutList<ENTRIES, DATA>;
-    TimeoutEntry *_next;
-    TimeoutEntry *_prev;
     timevalue _timeout;
-    DATA * data;
+    DATA *    data;
+    // the position in the heap, 0 if not programmed
+    unsigned  _pos;
     bool      _free;
   };
 
-  TimeoutEntry  _entries[ENTRIES];
+  // entry 0 is never allocated, thus 0 is not a valid timer
+  TimeoutEntry *_entries;
+  // the programmed timers, the earliest at index 1
+  unsigned     *_heap;
+  unsigned      _size;
+  unsigned      _count;
+
+  void set_size(unsigned new_size)
+  {
+    TimeoutEntry *entries = new TimeoutEntry[new_size];
+    unsigned     *heap    = new unsigned[new_size];
+    if (_entries) {
+      memcpy(entries, _entries, _size * sizeof(*_entries));
+      memcpy(heap, _heap, _size * sizeof(*_heap));
+      delete [] _entries;
+      delete [] _heap;
+    }
+    for (unsigned i = _size; i < new_size; i++) {
+      entries[i]._pos  = 0;
+      entries[i].data  = 0;
+      entries[i]._free = true;
+    }
+    _entries = entries;
+    _heap    = heap;
+    _size    = new_size;
+  }
+
+  void place(unsigned pos, unsigned nr) { _heap[pos] = nr; _entries[nr]._pos = pos; }
+
+  /**
+   * Move the timer at pos up or down the heap, until its parent is not
+   * later and its children are not earlier.
+   */
+  void sift(unsigned pos)
+  {
+    unsigned nr = _heap[pos];
+    timevalue to = _entries[nr]._timeout;
+    for (; pos > 1 && _entries[_heap[pos / 2]]._timeout > to; pos /= 2)
+      place(pos, _heap[pos / 2]);
+    for (unsigned child; (child = 2 * pos) <= _count; pos = child) {
+      if (child < _count && _entries[_heap[child + 1]]._timeout < _entries[_heap[child]]._timeout) child++;
+      if (_entries[_heap[child]]._timeout >= to) break;
+      place(pos, _heap[child]);
+    }
+    place(pos, nr);
+  }
+
 public:
   /**
    * Alloc a new timeout object.
@@ -98,21 +281,19 @@ public:
   unsigned alloc(DATA * _data = 0)
   {
     unsigned i;
-    for (i=1; i < ENTRIES; i++) {
-      if (not _entries[i]._free) continue;
-      _entries[i].data  = _data;
-      _entries[i]._free = false;
-      return i;
-    }
-    Logging::panic("Can't alloc a timer!\n");
-    return 0;
+    for (i=1; i < _size; i++)
+      if (_entries[i]._free) break;
+    if (i == _size) set_size(_size * 2);
+    _entries[i].data  = _data;
+    _entries[i]._free = false;
+    return i;
   }
 
   /**
    * Dealloc a timeout object.
    */
   unsigned dealloc(unsigned nr, bool withcancel = false) {
-    if (!nr || nr > ENTRIES - 1) return 0;
+    if (!nr || nr >= _size) return 0;
     if (_entries[nr]._free) return 0;
 
     // should only be done when no no concurrent access happens ...
@@ -123,41 +304,36 @@ public:
   }
 
   /**
-   * Cancel a programmed timeout.
+   * Cancel a programmed timeout.  Returns zero if it was the next one.
    */
   int cancel(unsigned nr)
   {
-    if (!nr || nr >= ENTRIES)  return -1;
-    TimeoutEntry *current = _entries+nr;
-    if (current->_next == current) return -2;
-    int res = _entries[0]._next != current;
-
-    current->_next->_prev =  current->_prev;
-    current->_prev->_next =  current->_next;
-    current->_next = current->_prev = current;
-    return res;
+    if (!nr || nr >= _size)  return -1;
+    unsigned pos = _entries[nr]._pos;
+    if (!pos) return -2;
+
+    _entries[nr]._pos = 0;
+    unsigned last = _heap[_count--];
+    if (last != nr) {
+      place(pos, last);
+      sift(pos);
+    }
+    return pos != 1;
   }
 
 
   /**
-   * Request a new timeout.
+   * Request a new timeout.  Returns true if the next timeout did not
+   * change.
    */
   int request(unsigned nr, timevalue to)
   {
-    if (!nr || nr > ENTRIES)  return -1;
+    if (!nr || nr >= _size)  return -1;
     timevalue old = timeout();
     TimeoutEntry *current = _entries + nr;
-    cancel(nr);
-
-    // keep a sorted list here
-    TimeoutEntry *t = _entries;
-    do { t = t->_next; }  while (t->_timeout < to);
-
     current->_timeout = to;
-    current->_next = t;
-    current->_prev = t->_prev;
-    t->_prev->_next = current;
-    t->_prev = current;
+    if (!current->_pos)  place(++_count, nr);
+    sift(current->_pos);
     return timeout() == old;
   }
 
@@ -165,8 +341,8 @@ public:
    * Get the head of the queue.
    */
   unsigned  trigger(timevalue now, DATA ** data = 0) {
-    if (now >= timeout()) {
-      unsigned i = _entries[0]._next - _entries;
+    if (_count && now >= timeout()) {
+      unsigned i = _heap[1];
       if (data)
         *data = _entries[i].data;
       return i;
@@ -174,18 +350,17 @@ public:
     return 0;
   }
 
-  timevalue timeout() { assert(_entries[0]._next); return _entries[0]._next->_timeout; }
+  timevalue timeout() { return _count ? _entries[_heap[1]]._timeout : ~0ULL; }
   void init()
   {
-    for (unsigned i = 0; i < ENTRIES; i++)
+    for (unsigned i = 0; i < _size; i++)
       {
-        _entries[i]._prev = _entries + i;
-        _entries[i]._next = _entries + i;
+        _entries[i]._pos  = 0;
         _entries[i].data  = 0;
         _entries[i]._free = true;
       }
-    _entries[0]._timeout = ~0ULL;
+    _count = 0;
   }
 
-  TimeoutList() { init(); }
+  TimeoutList() : _entries(0), _heap(0), _size(0), _count(0) { set_size(ENTRIES > 1 ? ENTRIES : 2); }
 };
@@ -32,6 +32,8 @@ struct CpuMessage {
     TYPE_TRIPLE,
     TYPE_INIT,
     TYPE_HLT,
+    TYPE_PAUSE,
+    TYPE_POLL,
     TYPE_INVD,
     TYPE_WBINVD,
     TYPE_CHECK_IRQ,
@@ -43,10 +45,12 @@ struct CpuMessage {
       CpuState *cpu;
       union {
         unsigned  cpuid_index;
+        timevalue deadline;   ///< TYPE_SINGLE_STEP: end the block when the TSC reaches it
         struct {
           unsigned  io_order;
           unsigned  short port;
           void     *dst;
+          unsigned  count;    ///< elements at dst for INS/OUTS, zero for a single access
         };
       };
     };
@@ -67,10 +71,13 @@ struct CpuMessage {
   // MTD_TSC is true;
   long long current_tsc_off;
 
-  CpuMessage(Type _type, CpuState *_cpu, unsigned _mtr_in) : type(_type), cpu(_cpu), mtr_in(_mtr_in), mtr_out(0), consumed(0) { if (type == TYPE_CPUID) cpuid_index = cpu->eax; }
+  CpuMessage(Type _type, CpuState *_cpu, unsigned _mtr_in) : type(_type), cpu(_cpu), mtr_in(_mtr_in), mtr_out(0), consumed(0) {
+    if (type == TYPE_CPUID) cpuid_index = cpu->eax;
+    if (type == TYPE_SINGLE_STEP) deadline = ~0ULL;
+  }
   CpuMessage(unsigned _nr, unsigned _reg, unsigned _mask, unsigned _value) : type(TYPE_CPUID_WRITE), nr(_nr), reg(_reg), mask(_mask), value(_value), consumed(0) {}
-  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in)
-  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
+  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in, unsigned _count = 0)
+  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), count(_count), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
 };
 
 
@@ -84,9 +91,13 @@ struct LapicEvent {
   enum Type{
     INTA,
     RESET,
-    INIT
+    INIT,
+    // access the TSC deadline in host TSC, zero if disarmed
+    DEADLINE_READ,
+    DEADLINE_WRITE
   } type;
   unsigned value;
+  timevalue deadline;
   LapicEvent(Type _type) : type(_type) { if (type == INTA) value = ~0u; }
 };
 
@@ -126,5 +137,7 @@ public:
   };
 
   unsigned long long inj_count;
-  VCpu (VCpu *last) : _last(last), inj_count(0) {}
+  // set when a new event arrives, thus an executor should end its block
+  volatile bool event_arrived;
+  VCpu (VCpu *last) : _last(last), inj_count(0), event_arrived(false) {}
 };
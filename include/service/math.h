@@ -47,4 +47,39 @@ struct Math
     lower /= divisor;
     return (upper << 32) + lower;
   }
+
+  /**
+   * Returns (value << shift) / divisor.  The result has to fit into 64
+   * bits.  This is slow and meant to precompute multipliers.
+   */
+  static uint64 shiftdiv(uint64 value, unsigned shift, uint64 divisor) {
+    uint64 res = value / divisor;
+    uint64 rem = value % divisor;
+    for (unsigned i = 0; i < shift; i++) {
+      bool carry = rem >> 63;
+      rem <<= 1;
+      res <<= 1;
+      if (carry || rem >= divisor) { rem -= divisor; res |= 1; }
+    }
+    return res;
+  }
+
+  /**
+   * Returns the 128-bit product of value and mult shifted right by
+   * shift, which is less than 64.
+   */
+  static uint64 mulshift(uint64 value, uint64 mult, unsigned shift) {
+#ifdef __x86_64__
+    return static_cast<uint64>((static_cast<unsigned __int128>(value) * mult) >> shift);
+#else
+    uint64 ll = static_cast<uint64>(static_cast<uint32>(value)) * static_cast<uint32>(mult);
+    uint64 lh = static_cast<uint64>(static_cast<uint32>(value)) * (mult >> 32);
+    uint64 hl = (value >> 32) * static_cast<uint32>(mult);
+    uint64 hh = (value >> 32) * (mult >> 32);
+    uint64 mid = (ll >> 32) + static_cast<uint32>(lh) + static_cast<uint32>(hl);
+    uint64 lo = (mid << 32) | static_cast<uint32>(ll);
+    uint64 hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return shift ? (hi << (64 - shift)) | (lo >> shift) : lo;
+#endif
+  }
 };
@@ -50,7 +50,7 @@ class AhciPort : public FisReceiver
 
 public:
 
-  void set_parent(ParentIrqProvider *parent, DBus<MessageMemRegion> *bus_memregion, DBus<MessageMem> *bus_mem)
+  void set_parent(ParentIrqProvider *parent, DBusMem<MessageMemRegion> *bus_memregion, DBusMem<MessageMem> *bus_mem)
   {
     _parent = parent;
     _bus_memregion = bus_memregion;
@@ -94,7 +94,6 @@ public:
 	    Logging::panic("XXX broken %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
 	  _inprogress &= ~mask;
 	  PxCI &= ~mask;
-	  PxSACT &= ~mask;
 	}
 	else
 	  Logging::printf("not finished %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
@@ -103,6 +102,14 @@ public:
 	assert(fislen == 7);
 	copy_offset = 0;
 	break;
+      case 0xa1: // set device bits fis
+	assert(fislen == 2);
+	copy_offset = 0x58;
+
+	// NCQ commands completed, possibly out of order
+	PxSACT &= ~fis[1];
+	if (fis[0] & 0x4000) PxIS |= 1 << 3;
+	break;
       case 0x5f: // pio setup fis
 	assert(fislen == 5);
 	copy_offset = 0x20;
@@ -296,7 +303,7 @@ class AhciController : public ParentIrqProvider,
     MAX_PORTS = 32,
   };
   DBus<MessageIrqLines> &_bus_irqlines;
-  DBus<MessageMem> 	&_bus_mem;
+  DBusMem<MessageMem> 	&_bus_mem;
   unsigned char _irq;
   AhciPort _ports[MAX_PORTS];
   unsigned _bdf;
@@ -77,8 +77,8 @@ PARAM_HANDLER(mio,
     Logging::panic("can not map IOMEM region %lx+%lx", msg.value, msg.len);
 
   DirectMemDevice *dev = new DirectMemDevice(msg.ptr, dest, 1 << size);
-  mb.bus_memregion.add(dev,  DirectMemDevice::receive_static<MessageMemRegion>);
-  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>);
+  mb.bus_memregion.add(dev,  DirectMemDevice::receive_static<MessageMemRegion>, dest, 1 << size);
+  mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>,       dest, 1 << size);
 
 }
 
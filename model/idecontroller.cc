@@ -223,8 +223,29 @@ private:
     return false;
   }
 
+  /**
+   * Number of bytes a counted access to the data port can move up to
+   * the end of the sector.
+   */
+  unsigned data_block(unsigned short port, unsigned type, unsigned count)
+  {
+    if ((port ^ PCI_BAR0) & PCI_BAR0_mask || port & ~PCI_BAR0_mask || _bufferoffset >= 512) return 0;
+    return MIN(count << type, (512 - _bufferoffset) & ~((1u << type) - 1));
+  }
+
+
   bool  receive(MessageIOIn &msg)
   {
+    if (msg.count) {
+      unsigned bytes = data_block(msg.port, msg.type, msg.count);
+      if (!bytes) return false;
+      memcpy(msg.ptr, _buffer + _bufferoffset, bytes);
+      msg.ptr    = reinterpret_cast<char *>(msg.ptr) + bytes;
+      msg.count -= bytes >> msg.type;
+      _bufferoffset += bytes;
+      if (_bufferoffset >= 512)  issue_command(false);
+      return true;
+    }
     if (!((msg.port ^ PCI_BAR0) & PCI_BAR0_mask)) {
       unsigned port = msg.port & ~PCI_BAR0_mask;
       if (port and msg.type != MessageIOIn::TYPE_INB) return false;
@@ -265,6 +286,15 @@ private:
 
   bool  receive(MessageIOOut &msg)
   {
+    if (msg.count) {
+      unsigned bytes = data_block(msg.port, msg.type, msg.count);
+      if (!bytes) return false;
+      memcpy(_buffer + _bufferoffset, msg.ptr, bytes);
+      msg.ptr    = reinterpret_cast<char *>(msg.ptr) + bytes;
+      msg.count -= bytes >> msg.type;
+      _bufferoffset += bytes;
+      return true;
+    }
     if (!((msg.port ^ PCI_BAR0) & PCI_BAR0_mask)) {
       unsigned port = msg.port & ~PCI_BAR0_mask;
       if (port and msg.type != MessageIOOut::TYPE_OUTB) return false;
@@ -310,8 +340,8 @@ private:
   {
     PCI_reset();
     reset_device();
-    Logging::printf("Instanciated IDE controller with bdf %#x for disk '%s' with %#Lx sectors\n",
-                    bdf, params.name, params.sectors);
+    Logging::printf("Instanciated IDE controller with bdf %#x for disk '%s' with %#zx sectors\n",
+                    bdf, params.name, size_t(params.sectors));
   }
 };
 
@@ -331,8 +361,8 @@ PARAM_HANDLER(ide,
   unsigned bdf = PciHelper::find_free_bdf(mb.bus_pcicfg, argv[3]);
   IdeController *dev = new IdeController(mb.bus_disk, mb.bus_irqlines, argv[2], bdf, msg.disknr, params, msg2.ptr + msg1.phys, msg1.phys);
   mb.bus_pcicfg.add(dev, IdeController::receive_static<MessagePciConfig>);
-  mb.bus_ioin.  add(dev, IdeController::receive_static<MessageIOIn>);
-  mb.bus_ioout. add(dev, IdeController::receive_static<MessageIOOut>);
+  mb.bus_ioin.  add_block(dev, IdeController::receive_static<MessageIOIn>);
+  mb.bus_ioout. add_block(dev, IdeController::receive_static<MessageIOOut>);
   mb.bus_diskcommit.add(dev, IdeController::receive_static<MessageDiskCommit>);
   // set default state; this is normally done by the BIOS
   // set MMIO region and IRQ
@@ -887,7 +887,7 @@ public:
   }
 
   Model82576vf(uint64 mac, DBus<MessageNetwork> &net,
-	       DBus<MessageMem> *bus_mem, DBus<MessageMemRegion> *bus_memregion,
+	       DBusMem<MessageMem> *bus_mem, DBusMem<MessageMemRegion> *bus_memregion,
 	       Clock *clock, DBus<MessageTimer> &timer,
 	       uint32 mem_mmio, uint32 mem_msix, unsigned txpoll_us, bool map_rx, unsigned bdf,
 	       bool promisc_default)
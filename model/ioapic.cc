@@ -259,7 +259,8 @@ public:
   IOApic(Motherboard &mb, uintptr_t base, unsigned gsibase) : _mb(mb), _base(base), _gsibase(gsibase)
   {
     reset();
-    _mb.bus_mem.add(this,       receive_static<MessageMem>);
+    _mb.bus_mem.add(this,       receive_static<MessageMem>, _base, 0x100);
+    _mb.bus_mem.claim(this,     receive_static<MessageMem>, MessageApic::IOAPIC_EOI, 4);
     _mb.bus_irqlines.add(this,  receive_static<MessageIrqLines>);
     _mb.bus_legacy.add(this,    receive_static<MessageLegacy>);
     _mb.bus_discovery.add(this, discover);
@@ -25,7 +25,7 @@
  * Lapic model.
  *
  * State: testing
- * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
+ * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, TSC deadline, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
  * Missing:  focus checking, CR8/TPR setting
  * Difference:  no interrupt polarity, lowest prio is round-robin
  * Documentation: Intel SDM Volume 3a Chapter 10 253668-033.
@@ -56,6 +56,8 @@ private:
   // dynamic state
   unsigned  _timer_dcr_shift;
   timevalue _timer_start;
+  // the TSC deadline in clock ticks, zero if disarmed
+  timevalue _timer_deadline;
   unsigned long long _msr;
   unsigned  _vector[8*3];
   unsigned  _esr_shadow;
@@ -68,6 +70,7 @@ private:
   bool sw_disabled() { return ~_SVR & 0x100; }
   bool hw_disabled() { return ~_msr & 0x800; }
   bool x2apic_mode() { return  (_msr & 0xc00) == 0xc00; }
+  bool deadline_mode() { return ((_TIMER >> 17) & 3) == 2; }
   unsigned x2apic_ldr() { return ((_initial_apic_id & ~0xf) << 12) | ( 1 << (_initial_apic_id & 0xf)); }
 
 
@@ -84,6 +87,7 @@ private:
 
     // init dynamic state
     _timer_dcr_shift = 1 + _timer_clock_shift;
+    _timer_deadline = 0;
     memset(_vector,  0, sizeof(_vector));
     memset(_lvtds,   0, sizeof(_lvtds));
     memset(_rirr,    0, sizeof(_rirr));
@@ -153,6 +157,15 @@ private:
    * counter value.
    */
   unsigned get_ccr(timevalue now) {
+    // the counter is not used in TSC-deadline mode
+    if (deadline_mode()) {
+      if (_timer_deadline && now >= _timer_deadline) {
+	_timer_deadline = 0;
+	trigger_lvt(_TIMER_offset - LVT_BASE);
+      }
+      return 0;
+    }
+
     if (!_ICT || !_timer_start)  return 0;
 
     timevalue delta = (now - _timer_start) >> _timer_dcr_shift;
@@ -179,8 +192,16 @@ private:
    */
   void update_timer(timevalue now) {
     unsigned value = get_ccr(now);
-    if (!value || _TIMER & (1 << LVT_MASK_BIT)) return;
-    MessageTimer msg(_timer, now + (timevalue(value) << _timer_dcr_shift));
+    if (_TIMER & (1 << LVT_MASK_BIT)) return;
+
+    // the deadline is already an absolute timeout
+    timevalue to = _timer_deadline;
+    if (!deadline_mode()) {
+      if (!value) return;
+      to = now + (timevalue(value) << _timer_dcr_shift);
+    }
+    else if (!to) return;
+    MessageTimer msg(_timer, to);
     _mb.bus_timer.send(msg);
   }
 
@@ -608,6 +629,18 @@ public:
       reset();
     else if (msg.type == LapicEvent::INIT)
       init();
+    else if (msg.type == LapicEvent::DEADLINE_READ || msg.type == LapicEvent::DEADLINE_WRITE) {
+      // only a TSC based clock can be programmed with TSC deadlines
+      if (!_mb.clock()->is_tsc()) return false;
+      if (msg.type == LapicEvent::DEADLINE_READ)
+	msg.deadline = deadline_mode() ? _timer_deadline : 0;
+      // writes are ignored in the other timer modes
+      else if (!hw_disabled() && deadline_mode()) {
+	COUNTER_INC("lapic deadline");
+	_timer_deadline = msg.deadline;
+	update_timer(_mb.clock()->time());
+      }
+    }
     return true;
   }
 
@@ -752,6 +785,8 @@ public:
       CpuMessage(11, 3, 0, _initial_apic_id),
       // support for APIC timer that does not sleep in C-states
       CpuMessage(6, 0, ~(1 << 2), 1 << 2),
+      // TSC-deadline mode, if the clock is the TSC
+      CpuMessage(1,  2, ~(1 << 24), _mb.clock()->is_tsc() << 24),
     };
     for (unsigned i=0; i < sizeof(msg) / sizeof(*msg); i++)
       _vcpu->executor.send(msg[i]);
@@ -801,7 +836,11 @@ REGSET(Lapic,
        REG_RW(_ESR,           0x28,          0, 0xffffffff, _ESR = Cpu::xchg(&_esr_shadow, 0U); return !value; )
        REG_RW(_ICR,           0x30,          0, 0x000ccfff, if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");)
        REG_RW(_ICR1,          0x31,          0, 0xff000000,)
-       REG_RW(_TIMER,         0x32, 0x00010000, 0x310ff, )
+       REG_RW(_TIMER,         0x32, 0x00010000, 0x710ff,
+	      if (deadline_mode() && !_mb.clock()->is_tsc()) _TIMER &= ~(1 << 18);
+	      // switching the mode disarms the timer
+	      if (!deadline_mode()) _timer_deadline = 0;
+	      else                  _timer_start = 0; )
        REG_RW(_TERM,          0x33, 0x00010000, 0x117ff, )
        REG_RW(_PERF,          0x34, 0x00010000, 0x117ff, )
        REG_RW(_LINT0,         0x35, 0x00010000, 0x1b7ff, )
@@ -809,6 +848,8 @@ REGSET(Lapic,
        REG_RW(_ERROR,         0x37, 0x00010000, 0x110ff, )
        REG_RW(_ICT,           0x38,          0, ~0u,
 	      COUNTER_INC("lapic ict");
+	      // the initial count is ignored in TSC-deadline mode
+	      if (deadline_mode()) return true;
 	      _timer_start = _mb.clock()->time();
 	      update_timer(_timer_start); )
        REG_RW(_DCR,           0x3e,          0, 0xb
@@ -817,6 +858,7 @@ REGSET(Lapic,
 		timevalue now = _mb.clock()->time();
 		unsigned  done = _ICT - get_ccr(now);
 		_timer_dcr_shift = _timer_clock_shift + ((((_DCR & 0x3) | ((_DCR >> 1) & 4)) + 1) & 7);
+		if (deadline_mode()) return true;
 
 		/**
 		 * Move timer_start in the past, which what would be
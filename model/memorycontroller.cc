@@ -34,7 +34,11 @@ public:
     if ((msg.phys < _start) || (msg.phys >= (_end - 4)))  return false;
     unsigned *ptr = reinterpret_cast<unsigned *>(_physmem + msg.phys);
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    if (msg.read) *msg.ptr = *ptr;
+    else {
+      *ptr = *msg.ptr;
+      CodeGeneration::modified(msg.phys, 4);
+    }
     return true;
   }
 
@@ -67,6 +71,6 @@ PARAM_HANDLER(mem,
   Logging::printf("physmem: %zx [%zx, %zx]\n", size_t(msg.value), start, end);
   MemoryController *dev = new MemoryController(msg.ptr, start, end);
   // physmem access
-  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>);
-  mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>);
+  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>,       start, end > start ? end - start : 0);
+  mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>, start, end > start ? end - start : 0);
 }
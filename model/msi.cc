@@ -62,6 +62,6 @@ public:
 PARAM_HANDLER(msi,
 	      "msi - provide MSI support by forwarding access to 0xfee00000 to the LocalAPICs.")
 {
-  mb.bus_mem.add(new Msi(mb.bus_apic), Msi::receive_static<MessageMem>);
+  mb.bus_mem.add(new Msi(mb.bus_apic), Msi::receive_static<MessageMem>, MessageMem::MSI_ADDRESS, 1 << 20);
 }
 
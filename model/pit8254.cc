@@ -64,6 +64,8 @@ class PitCounter : public StaticReceiver<PitCounter>
   DBus<MessageIrqLines> * _bus_irq;
   unsigned             _irq;
   Clock                _clock;
+  Clock::Domain        _domain;
+  TickCatchup          _ticks;
   unsigned             _timer;
   static const long FREQ = 1193180;
 
@@ -104,22 +106,58 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     _latch = get_counter();
     _stopped_out = feature(FPERIODIC) || get_out();
-    _start = _clock.clock(FREQ);
+    _start = _clock.clock(_domain);
     _stopped = 1;
+    _ticks.reset();
+  }
+
+
+  /**
+   * The length of a period.  A zero count means 65536.
+   */
+  timevalue period() { return _initial ? _initial : 65536; }
+
+
+  /**
+   * A count written while the counter runs, becomes active at the
+   * end of the current period.
+   */
+  void load_pending_counter(timevalue t)
+  {
+    if (!_stopped && t >= _start && _modus & NULL_COUNT)  load_counter();
+  }
+
+
+  /**
+   * The number of periods that have elapsed since the counter was
+   * loaded.
+   */
+  timevalue elapsed(timevalue t)
+  {
+    if (_stopped || t < _start)  return 0;
+    return (t - _start) / period() + 1;
   }
 
 
   /**
    * Rearm a new timeout.
+   *
+   * In periodic mode this is done only when the guest acknowledged
+   * the previous tick, the catch-up policy decides what happens with
+   * the periods that elapsed in the meantime.
    */
   void update_timer()
   {
     if (_irq == ~0U)  return;
-    timevalue t = _clock.clock(FREQ);
+    timevalue t = _clock.clock(_domain);
     timevalue to= _start;
-    if (feature(FPERIODIC))
-      to = t + (_initial + _start - t) % _initial;
-    MessageTimer msg(_timer, _clock.abstime((to < t) ? 0 : (to - t), FREQ));
+    if (feature(FPERIODIC) && !_stopped)
+      {
+	load_pending_counter(t);
+	timevalue e = elapsed(t);
+	to = t + _ticks.delay(e, _start + e * period() - t, period());
+      }
+    MessageTimer msg(_timer, _clock.abstime((to < t) ? 0 : (to - t), _domain));
     _bus_timer->send(msg);
   }
 
@@ -131,11 +169,11 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     if (_stopped)  return _latch;
 
-    long long res = _start - _clock.clock(FREQ);
+    long long res = _start - _clock.clock(_domain);
     if (_modus & BCD) res = (res % 10000);
 
     // are we still having an old value?
-    if (_start - _initial - 1 == _clock.clock(FREQ))
+    if (_start - _initial - 1 == _clock.clock(_domain))
       return _latch;
 
     if (res <= 0)  load_counter();
@@ -150,7 +188,8 @@ class PitCounter : public StaticReceiver<PitCounter>
     _latch = get_counter();
     _stopped_out = (_modus & 0xe) != 0 ? get_out() : 0;
     _stopped = 0;
-    _start = _clock.clock(FREQ) + _new_counter + 1;
+    _start = _clock.clock(_domain) + _new_counter + 1;
+    _ticks.reset();
     load_counter();
     update_timer();
   }
@@ -215,8 +254,9 @@ class PitCounter : public StaticReceiver<PitCounter>
 	else if (_stopped)
 	  {
 	    _initial = _latch ? _latch : 65536;
-	    _start = _clock.clock(FREQ) + _initial + 1;
+	    _start = _clock.clock(_domain) + _initial + 1;
 	    _stopped = 0;
+	    _ticks.reset();
 	  }
       }
   }
@@ -226,17 +266,17 @@ class PitCounter : public StaticReceiver<PitCounter>
    */
   bool get_out()
   {
-    if (_stopped || _start - _initial -1 == _clock.clock(FREQ))
+    if (_stopped || _start - _initial -1 == _clock.clock(_domain))
       return _stopped_out;
 
     if (feature(FCOUNTDOWN))
-      return _clock.clock(FREQ) >= _start;
+      return _clock.clock(_domain) >= _start;
     if (feature(FPERIODIC))
       if (!feature(FSQUARE_WAVE))
 	return get_counter() != 1;
       else
-	return ((_clock.clock(FREQ) - _start + _initial) % _initial)*2 < _initial;
-    return _clock.clock(FREQ) != _start;
+	return ((_clock.clock(_domain) - _start + _initial) % _initial)*2 < _initial;
+    return _clock.clock(_domain) != _start;
   }
 
   /**
@@ -315,7 +355,10 @@ class PitCounter : public StaticReceiver<PitCounter>
 	  if (_stopped)
 	    reload_counter();
 	  else
-	    _start = _clock.clock(FREQ) + get_counter();
+	    {
+	      _start = _clock.clock(_domain) + get_counter();
+	      _ticks.reset();
+	    }
 	}
   }
 
@@ -332,6 +375,18 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     if (msg.nr == _timer)
       {
+	// the counter was reprogrammed in the meantime, thus no tick is due
+	if (feature(FPERIODIC) && !_stopped)
+	  {
+	    timevalue t = _clock.clock(_domain);
+	    load_pending_counter(t);
+	    if (!_ticks.deliver(elapsed(t)))
+	      {
+		update_timer();
+		return true;
+	      }
+	  }
+
 	// a timeout has triggerd
 	MessageIrqLines msg1(MessageIrq::ASSERT_NOTIFY, _irq);
 	_bus_irq->send(msg1);
@@ -341,8 +396,8 @@ class PitCounter : public StaticReceiver<PitCounter>
   }
 
 
-  PitCounter(DBus<MessageTimer> *bus_timer, DBus<MessageIrqLines> *bus_irq, unsigned irq, Clock *clock)
-    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(bus_timer), _bus_irq(bus_irq), _irq(irq), _clock(*clock), _timer(0)
+  PitCounter(DBus<MessageTimer> *bus_timer, DBus<MessageIrqLines> *bus_irq, unsigned irq, Clock *clock, TickCatchup::Policy policy)
+    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(bus_timer), _bus_irq(bus_irq), _irq(irq), _clock(*clock), _domain(clock->domain(FREQ)), _ticks(policy), _timer(0)
   {
     assert(_clock.freq() != 0);
     if (_irq != ~0U)
@@ -353,7 +408,7 @@ class PitCounter : public StaticReceiver<PitCounter>
 	_timer = msg0.nr;
       };
   }
-  PitCounter() : _clock(0) {}
+  PitCounter() : _clock(FREQ), _domain(FREQ, FREQ) {}
 };
 
 
@@ -422,12 +477,12 @@ class PitDevice : public StaticReceiver<PitDevice>
  }
 
 
-  PitDevice(Motherboard &mb, unsigned short base, unsigned irq, unsigned pit)
+  PitDevice(Motherboard &mb, unsigned short base, unsigned irq, unsigned pit, TickCatchup::Policy policy)
     : _base(base), _addr(pit*COUNTER)
   {
     for (unsigned i=0; i < COUNTER; i++)
       {
-	_c[i] = PitCounter(&mb.bus_timer, &mb.bus_irqlines, i ? ~0U : irq, mb.clock());
+	_c[i] = PitCounter(&mb.bus_timer, &mb.bus_irqlines, i ? ~0U : irq, mb.clock(), policy);
 	if (!i) mb.bus_irqnotify.add(&_c[i], PitCounter::receive_static<MessageIrqNotify>);
 	if (!i) mb.bus_timeout.add(&_c[i],   PitCounter::receive_static<MessageTimeout>);
 	_c[i].set_gate(1);
@@ -437,16 +492,18 @@ class PitDevice : public StaticReceiver<PitDevice>
 
 
 PARAM_HANDLER(pit,
-	      "pit:iobase,irq - attach a PIT8254 to the system.",
-	      "Example: 'pit:0x40,0'")
+	      "pit:iobase,irq,catchup=0 - attach a PIT8254 to the system.",
+	      "Example: 'pit:0x40,0'",
+	      "The catchup policy for lost periodic ticks is 0 to coalesce, 1 to slew or 2 to replay them.")
 {
   static unsigned pit_count;
   PitDevice *dev = new PitDevice(mb,
 				 argv[0],
 				 argv[1],
-				 pit_count++);
+				 pit_count++,
+				 TickCatchup::policy(argv[2]));
 
-  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>,  argv[0], 4);
+  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>, argv[0], 4);
   mb.bus_pit.add(dev,   PitDevice::receive_static<MessagePit>);
 } 
@@ -33,11 +33,12 @@ public:
 private:
   unsigned _iobase;
   enum { FREQ = 3579545 };
+  Clock::Domain _domain;
 public:
   bool  receive(MessageIOIn &msg) {
 
     if (msg.port != _iobase || msg.type != MessageIOIn::TYPE_INL)  return false;
-    msg.value = _mb.clock()->clock(FREQ);
+    msg.value = _mb.clock()->clock(_domain);
     return true;
   }
 
@@ -52,9 +53,9 @@ public:
     discovery_write_dw("FACP", 216,          0, 4);
   }
 
-  PmTimer(Motherboard &mb, unsigned iobase) : _mb(mb), _iobase(iobase) {
+  PmTimer(Motherboard &mb, unsigned iobase) : _mb(mb), _iobase(iobase), _domain(mb.clock()->domain(FREQ)) {
 
-    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>);
+    _mb.bus_ioin.add(this,      receive_static<MessageIOIn>, _iobase, 4);
     _mb.bus_discovery.add(this, discover);
   }
 };
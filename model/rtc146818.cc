@@ -37,6 +37,9 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
   DBus<MessageTimer>    &_bus_timer;
   DBus<MessageIrqLines> &_bus_irqlines;
   Clock                *_clock;
+  // the divider chain runs at 2^30 Hz
+  Clock::Domain         _chain;
+  TickCatchup           _ticks;
   unsigned              _timer;
   unsigned short        _iobase;
   unsigned              _irq;
@@ -96,7 +99,7 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
 
   timevalue get_counter()
   {
-    timevalue value = _clock->clock(1 << 30);
+    timevalue value = _clock->clock(_chain);
     // scale the counter with the divider
     int divider = get_divider();
     if (divider < 0)  return 0;
@@ -118,6 +121,22 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
   }
 
 
+  /**
+   * The number of periodic interrupts since the counter started.
+   */
+  timevalue get_periodic_elapsed(timevalue now, unsigned periodic_tics) { return (now + periodic_tics/2) / periodic_tics; }
+
+
+  /**
+   * Restart the lost-tick accounting, e.g. after the rate changed.
+   */
+  void reset_periodic(timevalue now)
+  {
+    unsigned periodic_tics = get_periodic_tics();
+    if (periodic_tics) _ticks.reset(get_periodic_elapsed(now, periodic_tics));
+  }
+
+
   /**
    * Set the IRQ flags and raise an IRQ if needed.
    */
@@ -250,11 +269,16 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
     unsigned  fnow  = seconds % FREQ;
     if ((_ram[0xa] & 0x60) == 0x60) return fnow;
 
-    unsigned  flast = _last % FREQ;
     unsigned  periodic_tics = get_periodic_tics();
-
-    if (periodic_tics && ((fnow - periodic_tics/2) / periodic_tics) != ((flast - periodic_tics/2) / periodic_tics))
-      set_irqflags(_ram[0xc] | 0x40);
+    if (periodic_tics)
+      {
+	// a periodic interrupt is delivered only if the previous one was acknowledged
+	timevalue elapsed = get_periodic_elapsed(now, periodic_tics);
+	if (_ram[0xc] & 0x40)
+	  _ticks.skip(elapsed);
+	else if (_ticks.deliver(elapsed))
+	  set_irqflags(_ram[0xc] | 0x40);
+      }
     seconds /= FREQ;
 
     // update cycle if not SET and not in the very same second
@@ -272,13 +296,19 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
 
   /**
    * Reprogram the next timer.
+   *
+   * A pending periodic interrupt needs no timeout, as the guest has to
+   * read register C before the next one can be raised.
    */
   void update_timer(timevalue last_seconds, timevalue now)
   {
     timevalue next = 0;
     unsigned periodic_tics = get_periodic_tics();
-    if (_ram[0xb] & 0x40 && periodic_tics)
-      next = periodic_tics - (static_cast<unsigned>(now % FREQ) + periodic_tics/2) % periodic_tics;
+    if (_ram[0xb] & 0x40 && periodic_tics && ~_ram[0xc] & 0x40)
+      {
+	timevalue remaining = periodic_tics - (static_cast<unsigned>(now % FREQ) + periodic_tics/2) % periodic_tics;
+	next = _ticks.delay(get_periodic_elapsed(now, periodic_tics), remaining, periodic_tics);
+      }
     else if (_ram[0xb] & 0x10)
       next = FREQ - now % FREQ;
     else if (_ram[0xb] & 0x20)
@@ -313,6 +343,7 @@ public:
     update_ram(now / FREQ);
     set_irqflags(0);
     _offset = _last = 0;
+    reset_periodic(get_counter());
   }
 
 
@@ -377,6 +408,7 @@ public:
 		  _offset  = _clock->clock(FREQ) - FREQ/2;
 		  _last    = FREQ/2; // to make sure the periodic updates are right!
 		}
+	      reset_periodic(get_counter());
 	    }
 	    break;
 	  case 0xc:
@@ -416,26 +448,27 @@ public:
   }
 
 
-  Rtc146818(DBus<MessageTimer> &bus_timer, DBus<MessageIrqLines> &bus_irqlines, Clock *clock, unsigned timer, unsigned short iobase, unsigned irq)
-    : _bus_timer(bus_timer), _bus_irqlines(bus_irqlines), _clock(clock), _timer(timer), _iobase(iobase), _irq(irq)
+  Rtc146818(DBus<MessageTimer> &bus_timer, DBus<MessageIrqLines> &bus_irqlines, Clock *clock, unsigned timer, unsigned short iobase, unsigned irq, TickCatchup::Policy policy)
+    : _bus_timer(bus_timer), _bus_irqlines(bus_irqlines), _clock(clock), _chain(clock->domain(1 << 30)), _ticks(policy), _timer(timer), _iobase(iobase), _irq(irq)
   {}
 };
 
 PARAM_HANDLER(rtc,
-	      "rtc:iobase,irq - Attach a realtime clock including its CMOS RAM.",
-	      "Example: 'rtc:0x70,8'")
+	      "rtc:iobase,irq,catchup=0 - Attach a realtime clock including its CMOS RAM.",
+	      "Example: 'rtc:0x70,8'",
+	      "The catchup policy for lost periodic interrupts is 0 to coalesce, 1 to slew or 2 to replay them.")
 {
   MessageTimer msg0;
   if (!mb.bus_timer.send(msg0))
     Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
 
-  Rtc146818 *rtc = new Rtc146818(mb.bus_timer, mb.bus_irqlines, mb.clock(), msg0.nr, argv[0],argv[1]);
+  Rtc146818 *rtc = new Rtc146818(mb.bus_timer, mb.bus_irqlines, mb.clock(), msg0.nr, argv[0],argv[1], TickCatchup::policy(argv[2]));
   MessageTime msg1;
   if (!mb.bus_time.send(msg1))
     Logging::printf("could not get wallclock time!\n");
   rtc->reset(msg1);
-  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>);
-  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>);
+  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>, argv[0], 8);
+  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>, argv[0], 8);
   mb.bus_timeout.  add(rtc, Rtc146818::receive_static<MessageTimeout>);
   mb.bus_irqnotify.add(rtc, Rtc146818::receive_static<MessageIrqNotify>);
 }
@@ -23,8 +23,8 @@
  * RTL8029 device model.
  *
  * State: unstable
- * Features: PCI, send, receive, broadcast, promiscuous mode
- * Missing: multicast, CRC calculation, rep optimized
+ * Features: PCI, send, receive, broadcast, promiscuous mode, rep optimized
+ * Missing: multicast, CRC calculation
  */
 #ifndef REGBASE
 class Rtl8029: public StaticReceiver<Rtl8029>
@@ -266,6 +266,32 @@ class Rtl8029: public StaticReceiver<Rtl8029>
       }
   }
 
+  /**
+   * Move a block through the remote DMA port.  Returns the number of
+   * bytes done, zero if no suitable remote DMA is in progress.
+   */
+  unsigned remote_dma(unsigned long addr, unsigned type, unsigned count, unsigned char *ptr, bool write)
+  {
+    if (addr < 0x10 || addr + (1u << type) > 0x18 || (_regs.cr & 0x38) != (write ? 0x10 : 0x8)) return 0;
+    unsigned bytes = MIN(count << type, _regs.rbcr & ~((1u << type) - 1));
+    for (unsigned left = bytes; left; ) {
+      unsigned chunk = MIN(left, sizeof(_mem) - _regs.rsar);
+      if (!write)
+	memcpy(ptr, _mem + _regs.rsar, chunk);
+      else {
+	// the first page is read-only
+	unsigned skip = _regs.rsar < 0x100 ? MIN(chunk, 0x100u - _regs.rsar) : 0;
+	memcpy(_mem + _regs.rsar + skip, ptr + skip, chunk - skip);
+      }
+      _regs.rsar += chunk;
+      ptr  += chunk;
+      left -= chunk;
+    }
+    _regs.rbcr -= bytes;
+    if (bytes && !_regs.rbcr)  update_isr(0x40);
+    return bytes;
+  }
+
   bool match_bar(unsigned long &address) {
     bool res = !((address ^ PCI_BAR) & PCI_BAR_mask);
     address &= ~PCI_BAR_mask;
@@ -285,6 +311,13 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
+    if (msg.count) {
+      unsigned bytes = remote_dma(addr, msg.type, msg.count, reinterpret_cast<unsigned char *>(msg.ptr), false);
+      msg.ptr    = reinterpret_cast<char *>(msg.ptr) + bytes;
+      msg.count -= bytes >> msg.type;
+      return bytes;
+    }
+
     // for every byte
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       read_byte(addr, reinterpret_cast<unsigned char *>(&msg.value)+i);
@@ -299,6 +332,13 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
+    if (msg.count) {
+      unsigned bytes = remote_dma(addr, msg.type, msg.count, reinterpret_cast<unsigned char *>(msg.ptr), true);
+      msg.ptr    = reinterpret_cast<char *>(msg.ptr) + bytes;
+      msg.count -= bytes >> msg.type;
+      return bytes;
+    }
+
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       write_byte(addr, msg.value >> (i*8));
     return true;
@@ -337,8 +377,8 @@ PARAM_HANDLER(rtl8029,
   if (!mb.bus_hostop.send(msg))  Logging::panic("Could not get a MAC address");
   Rtl8029 *dev = new Rtl8029(mb.bus_network, mb.bus_irqlines, argv[1], msg.mac, PciHelper::find_free_bdf(mb.bus_pcicfg, argv[0]));
   mb.bus_pcicfg.add (dev, Rtl8029::receive_static<MessagePciConfig>);
-  mb.bus_ioin.add   (dev, Rtl8029::receive_static<MessageIOIn>);
-  mb.bus_ioout.add  (dev, Rtl8029::receive_static<MessageIOOut>);
+  mb.bus_ioin.add_block (dev, Rtl8029::receive_static<MessageIOIn>);
+  mb.bus_ioout.add_block(dev, Rtl8029::receive_static<MessageIOOut>);
   mb.bus_network.add(dev, Rtl8029::receive_static<MessageNetwork>);
 
 
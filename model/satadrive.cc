@@ -27,7 +27,7 @@
  * speaks the SATA transport layer protocol with its FISes.
  *
  * State: unstable
- * Features: read,write,identify
+ * Features: read,write,identify,NCQ
  * Missing: better error handling, many commands
  */
 class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
@@ -41,7 +41,8 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   unsigned char _status;
   unsigned char _error;
   unsigned _dsf[7];
-  unsigned _splits[32];
+  unsigned _splits[33]; // outstanding requests, indexed by slot+1
+  unsigned _queued;     // slots of NCQ commands
   DiskParameter _params;
   static unsigned const DMA_DESCRIPTORS = 64;
   DmaDescriptor _dma[DMA_DESCRIPTORS];
@@ -51,13 +52,13 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
    * A command is completed.
    * We send a register d2h FIS to the host.
    */
-  void complete_command()
+  void complete_command(bool irq = true)
   {
     // remove DRQ
     _status = _status & ~0x8;
 
     unsigned d2h[5];
-    d2h[0] = _error << 24 | _status << 16 | 0x4000 | _regs[0] & 0x0f00 | 0x34;
+    d2h[0] = _error << 24 | _status << 16 | (irq ? 0x4000 : 0) | _regs[0] & 0x0f00 | 0x34;
     d2h[1] = _regs[1];
     d2h[2] = _regs[2];
     d2h[3] = _regs[3] & 0xffff;
@@ -69,6 +70,37 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   }
 
 
+  /**
+   * NCQ commands are completed with a set device bits FIS.
+   */
+  void send_sdb_fis(unsigned tag)
+  {
+    unsigned sdb[2];
+    sdb[0] = _error << 24 | (_status & 0x77) << 16 | 0x4000 | 0xa1;
+    sdb[1] = 1 << (tag - 1);
+    _peer->receive_fis(2, sdb);
+  }
+
+
+  /**
+   * A request of a command is finished.  Complete the command when
+   * it was the last one.
+   */
+  void complete_split(unsigned tag)
+  {
+    assert(_splits[tag]);
+    if (--_splits[tag]) return;
+    if (_queued & (1 << (tag - 1))) {
+      _queued &= ~(1 << (tag - 1));
+      send_sdb_fis(tag);
+    }
+    else {
+      _dsf[6] = tag;
+      complete_command();
+    }
+  }
+
+
   void send_pio_setup_fis(unsigned short length, bool irq = false)
   {
     unsigned psf[5];
@@ -112,7 +144,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     identify[61] = maxlba28 >> 16;
     identify[64] = 3;      // pio 3+4
     identify[75] = 0x1f;   // NCQ depth 32
-    identify[76] = 0x002;   // disabled NCQ + 1.5gbit
+    identify[76] = 0x102;   // NCQ + 1.5gbit
     identify[80] = 1 << 6; // major version number: ata-6
     identify[83] = 0x4000 | 1 << 10; // lba48
     identify[86] = 1 << 10; // lba48 enabled
@@ -177,8 +209,8 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     if (!_dsf[3]) return 0;
     uintptr_t prdbase = union64(_dsf[2], _dsf[1]);
 
-    assert(_dsf[6] < 32);
-    assert(_splits[_dsf[6]] == 0);
+    assert(_dsf[6] && _dsf[6] <= 32);
+    assert(_splits[_dsf[6]] == 1);
 
     size_t prd = 0;
     size_t lastoffset = 0;
@@ -245,6 +277,20 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   };
 
 
+  /**
+   * Issue the requests of a non-queued command.  The command is
+   * completed when the last request was committed, which can happen
+   * before the send returns.
+   */
+  void issue_readwrite(bool read, bool lba48_ext)
+  {
+    unsigned tag = _dsf[6];
+    _splits[tag]++;
+    readwrite_sectors(read, lba48_ext);
+    complete_split(tag);
+  }
+
+
   /**
    * Execute ATA commands.
    */
@@ -266,7 +312,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  send_dma_setup_fis(true);
 	else
 	  send_pio_setup_fis(512);
-	readwrite_sectors(true, lba48_command);
+	issue_readwrite(true, lba48_command);
 	break;
       case 0x34: // WRITE SECTOR EXT
       case 0x35: // WRITE DMA EXT
@@ -279,7 +325,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  send_dma_setup_fis(false);
 	else
 	  send_pio_setup_fis(512);
-	readwrite_sectors(false, lba48_command);
+	issue_readwrite(false, lba48_command);
 	break;
       case 0x60: // READ  FPDMA QUEUED
 	read = true;
@@ -292,7 +338,16 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  _regs[0] = _regs[0] & 0x00ffffff | (feature << 24);
 	  _regs[2] = _regs[2] & 0x00ffffff | (feature << 16) & 0xff000000;
 	  send_dma_setup_fis(read);
+
+	  // the command stays active until its tag is cleared in a
+	  // set device bits FIS, but the bus is released now
+	  unsigned tag = _dsf[6];
+	  _queued |= 1 << (tag - 1);
+	  _splits[tag]++;
 	  readwrite_sectors(read, true);
+	  _status = _status & ~0x88;
+	  complete_command(false);
+	  complete_split(tag);
 	}
 	break;
       case 0xc6: // SET MULTIPLE
@@ -341,6 +396,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     _error = 1;
     _ctrl = _regs[3] >> 24;
     memset(_splits, 0, sizeof(_splits));
+    _queued = 0;
     complete_command();
   };
 
@@ -389,22 +445,17 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 
   bool receive(MessageDiskCommit &msg)
   {
-    if (msg.disknr != _hostdisk || msg.usertag > 32) return false;
+    if (msg.disknr != _hostdisk || !msg.usertag || msg.usertag > 32) return false;
     // we are done
     _status = _status & ~0x8;
-    assert(_splits[msg.usertag]);
     assert(!msg.status);
-    if (!--_splits[msg.usertag])
-      {
-	_dsf[6] = msg.usertag;
-	complete_command();
-      }
+    complete_split(msg.usertag);
     return true;
   }
 
 
-  SataDrive(DBus<MessageDisk> &bus_disk, DBus<MessageMemRegion> *bus_memregion, DBus<MessageMem> *bus_mem, unsigned hostdisk, DiskParameter params)
-    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _params(params), _dma()
+  SataDrive(DBus<MessageDisk> &bus_disk, DBusMem<MessageMemRegion> *bus_memregion, DBusMem<MessageMem> *bus_mem, unsigned hostdisk, DiskParameter params)
+    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _queued(), _params(params), _dma()
   {
     Logging::printf("SATA disk %x flags %x sectors %zx\n", hostdisk, _params.flags, size_t(_params.sectors));
   }
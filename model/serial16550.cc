@@ -254,8 +254,8 @@ public:
       memset(_regs, 0, sizeof(_regs));
       _regs[LSR] = 0x60;
       _regs[MSR] = 0xb0;
-      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>);
-      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>);
+      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>, _base, 8);
+      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>, _base, 8);
       _mb.bus_serial.   add(this, receive_static<MessageSerial>);
       _mb.bus_discovery.add(this, discover);
     }
@@ -102,6 +102,8 @@ PARAM_HANDLER(scp,
 	      "Example: 'scp:0x92,0x61'")
 {
   SystemControlPort *scp = new SystemControlPort(mb.bus_legacy, mb.bus_pit, argv[0], argv[1]);
-  mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>,  argv[0], 1);
+  mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>, argv[0], 1);
+  mb.bus_ioin.claim(scp,  SystemControlPort::receive_static<MessageIOIn>,  argv[1], 1);
+  mb.bus_ioout.claim(scp, SystemControlPort::receive_static<MessageIOOut>, argv[1], 1);
 }
@@ -26,6 +26,11 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 #define REGBASE "../model/vcpu.cc"
 #include "model/reg.h"
 
+  enum {
+    // the longest a polling guest sleeps in nanoseconds
+    POLL_WAIT = 1000000
+  };
+
   uintptr_t _hostop_id;
   Motherboard &_mb;
   long long _reset_tsc_off;
@@ -97,6 +102,14 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
     case 0x10:
       handle_rdtsc(msg);
       break;
+    case 0x6e0: // TSC deadline
+      {
+	assert(msg.mtr_in & MTD_TSC);
+	LapicEvent msg2(LapicEvent::DEADLINE_READ);
+	if (!bus_lapic.send(msg2)) { GP0(msg); break; }
+	msg.cpu->edx_eax(msg2.deadline ? msg2.deadline + get_tsc_off(msg) : 0);
+      }
+      break;
     case 0x174 ... 0x176:
       assert(msg.mtr_in & MTD_SYSENTER);
       msg.cpu->edx_eax((&msg.cpu->sysenter_cs)[msg.cpu->ecx - 0x174]);
@@ -133,6 +146,16 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
         }
 	msg.mtr_out |= MTD_TSC;
 	break;
+      case 0x6e0: // TSC deadline
+	assert(msg.mtr_in & MTD_TSC);
+	{
+	  // the LAPIC arms its timer on the deadline in host TSC
+	  LapicEvent msg2(LapicEvent::DEADLINE_WRITE);
+	  msg2.deadline = cpu->edx_eax() ? cpu->edx_eax() - get_tsc_off(msg) : 0;
+	  if (cpu->edx_eax() && !msg2.deadline) msg2.deadline = 1;
+	  if (!bus_lapic.send(msg2)) GP0(msg);
+	}
+	break;
       case 0x174 ... 0x176:
 	(&cpu->sysenter_cs)[cpu->ecx - 0x174] = cpu->edx_eax();
 	msg.mtr_out |= MTD_SYSENTER;
@@ -196,6 +219,8 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
    */
   void prioritize_events(CpuMessage &msg) {
     CpuState *cpu = msg.cpu;
+    // clear it before we look, so that a later event is not missed
+    event_arrived = false;
     unsigned old_event = _event;
 
     assert(msg.mtr_in & MTD_STATE);
@@ -283,7 +308,24 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
     cpu->actv_state = 0;
   }
 
+  /**
+   * A string I/O instruction: try to move a block of elements at
+   * once.  The count is updated to the elements left.
+   */
+  void handle_ioin_block(CpuMessage &msg) {
+    MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port, msg.count, msg.dst);
+    if (_mb.bus_ioin.send(msg2))  msg.count = msg2.count;
+  }
+
+
+  void handle_ioout_block(CpuMessage &msg) {
+    MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, msg.count, msg.dst);
+    if (_mb.bus_ioout.send(msg2))  msg.count = msg2.count;
+  }
+
+
   void handle_ioin(CpuMessage &msg) {
+    if (msg.count)  return handle_ioin_block(msg);
     MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
     bool res = _mb.bus_ioin.send(msg2);
 
@@ -298,6 +340,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 
   void handle_ioout(CpuMessage &msg) {
+    if (msg.count)  return handle_ioout_block(msg);
     MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
     Cpu::move(&msg2.value, msg.dst, msg.io_order);
 
@@ -332,12 +375,26 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
       if (Cpu::cmpxchg4b(&_sipi, 0, value)) return;
 
     Cpu::atomic_or<volatile unsigned>(&_event, STATE_WAKEUP | (value & (EVENT_MASK | EVENT_DEBUG | EVENT_HOST)));
+    event_arrived = true;
 
 
     MessageHostOp msg(MessageHostOp::OP_VCPU_RELEASE, _hostop_id, _event & STATE_BLOCK);
     _mb.bus_hostop.send(msg);
   }
 
+
+  /**
+   * The guest spins without progress.  Give the host CPU away until
+   * the next event, but at most for wait nanoseconds.  A zero wait
+   * only lets the other threads in.
+   */
+  void yield(unsigned long wait) {
+    MessageHostOp msg(MessageHostOp::OP_VCPU_YIELD, _hostop_id, wait);
+    Cpu::atomic_or<volatile unsigned>(&_event, STATE_BLOCK);
+    if (~_event & STATE_WAKEUP) _mb.bus_hostop.send(msg);
+    Cpu::atomic_and<volatile unsigned>(&_event, ~(STATE_BLOCK | STATE_WAKEUP));
+  }
+
 public:
   /**
    * Forward MEM requests to the motherboard.
@@ -432,6 +489,15 @@ public:
       assert(!msg.cpu->actv_state);
       msg.cpu->actv_state = 1;
       break;
+    case CpuMessage::TYPE_PAUSE:
+      COUNTER_INC("spin pause");
+      yield(0);
+      return true;
+    case CpuMessage::TYPE_POLL:
+      // a device changes its state on a timeout or when a host thread delivers input
+      COUNTER_INC("spin poll");
+      yield(POLL_WAIT);
+      return true;
     case CpuMessage::TYPE_CHECK_IRQ:
       // we handle it later on
       break;
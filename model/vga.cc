@@ -570,11 +570,13 @@ PARAM_HANDLER(vga,
     Logging::panic("%s failed to alloc %zd from guest memory\n", __PRETTY_FUNCTION__, fbsize);
 
   Vga *dev = new Vga(mb, argv[0], msg2.ptr + msg.phys, msg.phys, fbsize);
-  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>);
-  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>);
+  mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>, argv[0], 32);
+  mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>, argv[0], 32);
   mb.bus_bios     .add(dev, Vga::receive_static<MessageBios>);
-  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>);
-  mb.bus_memregion.add(dev, Vga::receive_static<MessageMemRegion>);
+  mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>, msg.phys, fbsize);
+  mb.bus_memregion.add(dev, Vga::receive_static<MessageMemRegion>, msg.phys, fbsize);
+  mb.bus_mem      .claim(dev, Vga::receive_static<MessageMem>, 0xa0000, 0x20000);
+  mb.bus_memregion.claim(dev, Vga::receive_static<MessageMemRegion>, 0xa0000, 0x20000);
   mb.bus_discovery.add(dev, Vga::receive_static<MessageDiscovery>);
 }
 
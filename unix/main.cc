@@ -36,15 +36,20 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <time.h>
-#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
 
+#include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <seoul/unix.h>
@@ -57,7 +62,10 @@ const char version_str[] =
 
 static char  *ram;
 static size_t ram_size = 128 << 20; // 128 MB
+static size_t ram_mapped;           // Including the memory allocated from the guest.
 static int    tap_fd;               // TAP device. If 0, network packets go to /dev/null.
+static unsigned disk_threads = 4;   // Disk requests that can be in flight at once.
+static unsigned timer_slack  = 50;  // Microseconds a timeout may fire late to save a re-arm.
 
 static const char *pc_ps2[] = {
   // Unix backend
@@ -95,12 +103,51 @@ static const char *pc_ps2[] = {
 
 static TimeoutList<32, void> timeouts;
 static timevalue             last_to = ~0ULL;
-static timer_t               timer_id;
+static int                   timer_fd;
 
 
-static Clock                 mb_clock(1000000);   // XXX Use correct frequency
+static Clock                 mb_clock(1);         // Calibrated in main().
+static Clock::Domain         mb_ns(1, 1);         // Nanoseconds in mb_clock.
+static timevalue             timer_slack_ticks;
 static Motherboard           mb(&mb_clock, NULL);
 
+static timevalue monotonic_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return timevalue(t.tv_sec) * 1000000000UL + t.tv_nsec;
+}
+
+// The clock runs on the TSC if it is invariant. Otherwise it falls
+// back to CLOCK_MONOTONIC.
+static Clock calibrate_clock()
+{
+  unsigned ebx = 0, ecx = 0, edx = 0;
+  bool invariant = Cpu::cpuid(0x80000000, ebx, ecx, edx) >= 0x80000007;
+  if (invariant) {
+    ecx = 0;
+    Cpu::cpuid(0x80000007, ebx, ecx, edx);
+    invariant = edx & (1 << 8);
+  }
+  if (not invariant) {
+    printf("Clock: no invariant TSC, using CLOCK_MONOTONIC.\n");
+    return Clock(1000000000UL, monotonic_ns);
+  }
+
+  // Count the TSC ticks during 20ms of CLOCK_MONOTONIC.
+  timevalue ns  = monotonic_ns();
+  timevalue tsc = Cpu::rdtsc();
+  struct timespec wait = { 0, 20000000 };
+  while (nanosleep(&wait, &wait) and errno == EINTR)
+    ;
+  tsc = Cpu::rdtsc() - tsc;
+  ns  = monotonic_ns() - ns;
+
+  timevalue freq = Math::muldiv128(tsc, 1000000000UL, ns);
+  printf("Clock: invariant TSC at %llu kHz.\n", freq / 1000);
+  return Clock(freq);
+}
+
 // Multiboot module data
 
 struct Module {
@@ -163,7 +210,8 @@ struct Disk {
 
 static std::vector<Disk> disks;
 
-// Used to serialize all operations (for now).
+// Serializes the device models and interrupt delivery. The
+// instruction emulator releases it while it only touches RAM.
 pthread_mutex_t irq_mtx;
 
 static void skip_instruction(CpuMessage &msg)
@@ -187,6 +235,9 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
   assert(vcpu);
   CpuMessage msg(type, static_cast<CpuState *>(utcb), utcb->mtd);
   msg.mtr_in = ~0U;
+  // Let the executor stop when the next timeout is due.
+  if (type == CpuMessage::TYPE_SINGLE_STEP and mb_clock.is_tsc())
+    msg.deadline = timeouts.timeout();
   if (skip) skip_instruction(msg);
 
   /**
@@ -231,7 +282,11 @@ static void *vcpu_thread_fn(void *arg)
 
   while (true) {
     pthread_mutex_lock(&irq_mtx);
+    // Halifax executes up to 'halifax:maxblock' instructions per step
+    // without the lock.  The step ends early at I/O, HLT, a new event
+    // or the next timeout.
     handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
+    COUNTER_INC("vcpu step");
     // Logging::printf("eip %x\n", cpu_state.eip);
     pthread_mutex_unlock(&irq_mtx);
   }
@@ -290,6 +345,33 @@ static bool receive(Device *, MessageHostOp &msg)
     case MessageHostOp::OP_VCPU_RELEASE:
       sem_post(&vcpu_info[msg.value].block);
       break;
+    case MessageHostOp::OP_VCPU_YIELD: {
+      // Sleep until a release, but not beyond the next timeout.
+      unsigned long long wait = msg.len;
+      timevalue next_to = timeouts.timeout();
+      if (wait && next_to != ~0ULL)
+        wait = std::min(wait, mb_clock.delta(next_to, mb_ns));
+
+      pthread_mutex_unlock(&irq_mtx);
+      if (wait) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        wait += t.tv_nsec;
+        t.tv_sec  += wait / 1000000000UL;
+        t.tv_nsec  = wait % 1000000000UL;
+        while (sem_timedwait(&vcpu_info[msg.value].block, &t) and errno == EINTR)
+          ;
+      } else
+        sched_yield();
+      pthread_mutex_lock(&irq_mtx);
+      break;
+    }
+    case MessageHostOp::OP_DEVICE_LOCK:
+      pthread_mutex_lock(&irq_mtx);
+      break;
+    case MessageHostOp::OP_DEVICE_UNLOCK:
+      pthread_mutex_unlock(&irq_mtx);
+      break;
     case MessageHostOp::OP_GET_MODULE:
       // For historical reasons, modules numbers start with 1.
       msg.module --;
@@ -346,7 +428,7 @@ static void timeout_request()
 {
   timevalue next_to = timeouts.timeout();
   if (next_to != ~0ULL) {
-    unsigned long long delta = mb_clock.delta(next_to, 1000000000UL);
+    unsigned long long delta = mb_clock.delta(next_to, mb_ns);
 
     if (delta == 0) {
       // Timeout pending NOW. Skip programming a timeout.
@@ -354,8 +436,10 @@ static void timeout_request()
 
       // We might have a new timeout pending.
       timeout_request();
-    } else if (next_to != last_to) {
-      // New timeout. Reprogram timer.
+    } else if (last_to == ~0ULL or next_to + timer_slack_ticks < last_to) {
+      // New timeout. Reprogram timer. A programmed timer that fires
+      // earlier or only within the slack later is kept, the trigger
+      // reprograms it anyway.
 
       last_to = next_to;
 
@@ -365,15 +449,46 @@ static void timeout_request()
         .it_interval = {0, 0},
         .it_value = {long(delta / 1000000000L), (long)(delta % 1000000000L)}
       };
-      int res = timer_settime(timer_id, 0, &t, NULL);
+      int res = timerfd_settime(timer_fd, 0, &t, NULL);
       assert(!res);
-    }
+    } else
+      COUNTER_INC("timer coalesced");
   }
 }
 
-static void timeout_handler_fn(union sigval)
+// How late the host timer fired, in nanoseconds.
+static struct {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+} timer_latency;
+
+// The VCPU threads never return, we leave through exit() when the
+// user quits.  The statistics are read without the lock, which is
+// good enough for a report.
+static void print_timer_latency()
+{
+  if (timer_latency.count)
+    printf("Timer latency: %llu fires, %lluns average, %lluns max.\n", timer_latency.count,
+           timer_latency.sum / timer_latency.count, timer_latency.max);
+}
+
+static void timer_event()
 {
+  uint64 expirations;
+  // Nothing to do, if the timer was reprogrammed in the meantime.
+  if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
   pthread_mutex_lock(&irq_mtx);
+  timevalue now = mb_clock.time();
+  timevalue due = timeouts.timeout();
+  if (due <= now) {
+    unsigned long long late = mb_ns.to.apply(now - due);
+    timer_latency.count++;
+    timer_latency.sum += late;
+    if (late > timer_latency.max) timer_latency.max = late;
+    COUNTER_SET("timer max latency", timer_latency.max);
+  }
   timeout_trigger();
   timeout_request();
   pthread_mutex_unlock(&irq_mtx);
@@ -410,31 +525,22 @@ static bool receive(Device *, MessageTime &msg)
 // Network support
 
 static unsigned char network_pbuf[2048];
+static int           epoll_fd;
 
-static void *network_io_thread_fn(void *)
+static void network_event()
 {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(tap_fd, &set);
-
-  while (true) {
-    fd_set rset = set;
-    if (0 > select(tap_fd + 1, &rset, nullptr, nullptr, nullptr)) {
-      perror("select");
-      break;
-    }
-
-    int  res = read(tap_fd, network_pbuf, sizeof(network_pbuf));
-    if (res <= 0) break;
-    printf("tap: read %u bytes.\n", res);
-    MessageNetwork msg(network_pbuf, res, 0);
-
-    pthread_mutex_lock(&irq_mtx);
-    mb.bus_network.send(msg);
-    pthread_mutex_unlock(&irq_mtx);
+  int  res = read(tap_fd, network_pbuf, sizeof(network_pbuf));
+  if (res <= 0) {
+    if (res < 0 and errno == EINTR) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tap_fd, nullptr);
+    return;
   }
+  printf("tap: read %u bytes.\n", res);
+  MessageNetwork msg(network_pbuf, res, 0);
 
-  return nullptr;
+  pthread_mutex_lock(&irq_mtx);
+  mb.bus_network.send(msg);
+  pthread_mutex_unlock(&irq_mtx);
 }
 
 static bool receive(Device *, MessageNetwork &msg)
@@ -456,45 +562,195 @@ static bool receive(Device *, MessageNetwork &msg)
 
 }
 
+// Disk requests are queued and executed by a pool of IO threads, so
+// that the VCPUs do not wait for the host disk.  The completions are
+// sent from the event thread.
+
+struct DiskRequest {
+  MessageDisk::Type  type;
+  unsigned           disknr;
+  unsigned long      usertag;
+  off_t              offset;
+  std::vector<iovec> iov;
+  size_t             done;    // Bytes transferred by the IO thread.
+  MessageDisk::Status status;
+};
+
+static std::deque<DiskRequest *> disk_queue;
+static std::deque<DiskRequest *> disk_done;
+static pthread_mutex_t           disk_mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t            disk_cond = PTHREAD_COND_INITIALIZER;
+static int                       disk_event_fd;
+
+static void disk_commit(unsigned disknr, unsigned long usertag, MessageDisk::Status status)
+{
+  MessageDiskCommit cmsg(disknr, usertag, status);
+  mb.bus_diskcommit.send(cmsg);
+}
+
+static void *disk_io_thread_fn(void *)
+{
+  while (true) {
+    pthread_mutex_lock(&disk_mtx);
+    while (disk_queue.empty())
+      pthread_cond_wait(&disk_cond, &disk_mtx);
+    DiskRequest *req = disk_queue.front();
+    disk_queue.pop_front();
+    pthread_mutex_unlock(&disk_mtx);
+
+    Disk  &disk = disks[req->disknr];
+    size_t done = 0;
+    req->status = MessageDisk::DISK_OK;
+    if (req->type == MessageDisk::DISK_FLUSH_CACHE) {
+      if (0 != fdatasync(disk.fd)) {
+        perror("fdatasync");
+        req->status = MessageDisk::DISK_STATUS_DEVICE;
+      }
+    } else {
+      // Transfer the whole descriptor list at once and restart
+      // after short transfers.
+      std::vector<iovec> work(req->iov);
+      iovec   *iov   = work.data();
+      unsigned count = work.size();
+      while (count) {
+        ssize_t bytes = (req->type == MessageDisk::DISK_READ) ?
+          preadv (disk.fd, iov, count, req->offset + done) :
+          pwritev(disk.fd, iov, count, req->offset + done);
+        if (bytes <= 0) {
+          if (bytes < 0 and errno == EINTR) continue;
+          Logging::printf("short read/write: %zd at %zd\n", bytes, done);
+          // Report the descriptor that was not completely transferred.
+          req->status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
+                                            ((iov - work.data()) << MessageDisk::DISK_STATUS_SHIFT));
+          break;
+        }
+        done += bytes;
+        for (; count and size_t(bytes) >= iov->iov_len; count--, iov++)
+          bytes -= iov->iov_len;
+        if (count) {
+          iov->iov_base = reinterpret_cast<char *>(iov->iov_base) + bytes;
+          iov->iov_len -= bytes;
+        }
+      }
+    }
+    req->done = done;
+
+    pthread_mutex_lock(&disk_mtx);
+    disk_done.push_back(req);
+    pthread_mutex_unlock(&disk_mtx);
+
+    uint64 one = 1;
+    if (write(disk_event_fd, &one, sizeof(one)) != sizeof(one)) perror("write to eventfd");
+  }
+  return nullptr;
+}
+
+// Commit all finished requests under a single lock acquisition.
+static void disk_event()
+{
+  uint64 count;
+  if (read(disk_event_fd, &count, sizeof(count)) != sizeof(count)) return;
+
+  std::deque<DiskRequest *> done;
+  pthread_mutex_lock(&disk_mtx);
+  done.swap(disk_done);
+  pthread_mutex_unlock(&disk_mtx);
+
+  pthread_mutex_lock(&irq_mtx);
+  for (DiskRequest *req : done) {
+    // Cached code in the memory that was read is stale now.
+    size_t left = req->type == MessageDisk::DISK_READ ? req->done : 0;
+    for (size_t i = 0; left; i++) {
+      size_t len = std::min(left, req->iov[i].iov_len);
+      CodeGeneration::modified(reinterpret_cast<char *>(req->iov[i].iov_base) - ram, len);
+      left -= len;
+    }
+    disk_commit(req->disknr, req->usertag, req->status);
+  }
+  pthread_mutex_unlock(&irq_mtx);
+
+  for (DiskRequest *req : done)
+    delete req;
+}
+
+// The event thread serves the host timer, the TAP device and the
+// disk completions.  Each of them takes irq_mtx only to deliver its
+// messages.
+static void *event_thread_fn(void *)
+{
+  epoll_event events[4];
+  while (true) {
+    int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == timer_fd)           timer_event();
+      else if (fd == disk_event_fd) disk_event();
+      else if (fd == tap_fd)        network_event();
+    }
+  }
+  return nullptr;
+}
+
+static bool add_event_fd(int fd)
+{
+  epoll_event ev;
+  ev.events  = EPOLLIN;
+  ev.data.fd = fd;
+  return 0 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
 static bool receive(Device *, MessageDisk &msg)
 {
   if (msg.disknr >= disks.size()) return false;
 
   Disk               &disk   = disks[msg.disknr];
-  MessageDisk::Status status = MessageDisk::DISK_OK;
   unsigned long long  offset = msg.sector << 9;
 
   switch (msg.type) {
   case MessageDisk::DISK_READ:
   case MessageDisk::DISK_WRITE:
-    for (unsigned i=0; i < msg.dmacount; i++) {
-      size_t  start = offset;
-      size_t  end   = start + msg.dma[i].bytecount;
-      ssize_t bytes;
-
-      if (end > disk.size or start > disk.size or
-          msg.dma[i].byteoffset > msg.physsize or
-          msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize) {
-        status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
-                                     (i << MessageDisk::DISK_STATUS_SHIFT));
-        break;
-      }
-
-      // XXX Workaround, use hostop GUEST_MEM.
-      msg.physoffset = reinterpret_cast<uintptr_t>(ram);
-
-      typedef int (*RWFn)(int,void *,size_t,off_t);
-      bytes = ((msg.type == MessageDisk::DISK_READ) ? (RWFn)pread : (RWFn)pwrite)
-        (disk.fd, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset),
-         end - start, start);
-
-      if (bytes < ssize_t(end - start)) {
-        Logging::printf("short read/write: %zd instead of %zd\n", bytes, end - start);
+  case MessageDisk::DISK_FLUSH_CACHE:
+    {
+      DiskRequest *req = new DiskRequest;
+      req->type    = msg.type;
+      req->disknr  = msg.disknr;
+      req->usertag = msg.usertag;
+      req->offset  = offset;
+
+      for (unsigned i=0; msg.type != MessageDisk::DISK_FLUSH_CACHE and i < msg.dmacount; i++) {
+        size_t  start = offset;
+        size_t  end   = start + msg.dma[i].bytecount;
+
+        if (end > disk.size or start > disk.size or
+            msg.dma[i].byteoffset > msg.physsize or
+            msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize or
+            msg.dma[i].byteoffset + msg.dma[i].bytecount > ram_mapped) {
+          delete req;
+          disk_commit(msg.disknr, msg.usertag,
+                      MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
+                                          (i << MessageDisk::DISK_STATUS_SHIFT)));
+          return true;
+        }
+
+        // XXX Workaround, use hostop GUEST_MEM.
+        msg.physoffset = reinterpret_cast<uintptr_t>(ram);
+
+        iovec v = { reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset), end - start };
+        req->iov.push_back(v);
+        offset += end - start;
       }
 
-      offset += end - start;
+      pthread_mutex_lock(&disk_mtx);
+      disk_queue.push_back(req);
+      pthread_cond_signal(&disk_cond);
+      pthread_mutex_unlock(&disk_mtx);
+      return true;
     }
-    break;
   case MessageDisk::DISK_GET_PARAMS:
     {
       msg.params->flags = DiskParameter::FLAG_HARDDISK;
@@ -504,21 +760,15 @@ static bool receive(Device *, MessageDisk &msg)
       strncpy(msg.params->name, disk.name, sizeof(msg.params->name));
       return true;
     }
-  case MessageDisk::DISK_FLUSH_CACHE:
-    break;
   default:
     assert(0);
   }
-
-  MessageDiskCommit cmsg(msg.disknr, msg.usertag, status);
-  mb.bus_diskcommit.send(cmsg);
-
-  return true;
+  return false;
 }
 
 static void usage()
 {
-  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [kernel parameters] [module1 parameters] ...\n");
+  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-s timer-slack-us] [kernel parameters] [module1 parameters] ...\n");
   exit(EXIT_FAILURE);
 }
 
@@ -529,7 +779,7 @@ int main(int argc, char **argv)
          version_str);
 
   int ch;
-  while ((ch = getopt(argc, argv, "hm:n:d:")) != -1) {
+  while ((ch = getopt(argc, argv, "hm:n:d:s:")) != -1) {
     switch (ch) {
     case 'm':
       ram_size = atoi(optarg) << 20;
@@ -544,6 +794,9 @@ int main(int argc, char **argv)
     case 'd':
       disks.push_back(Disk::from_file(optarg));
       break;
+    case 's':
+      timer_slack = atoi(optarg);
+      break;
     case 'h':
     case '?':
     default:
@@ -561,6 +814,10 @@ int main(int argc, char **argv)
     modules.push_back(Module::from_file(argv[i], argv[i+1]));
   }
 
+  mb_clock          = calibrate_clock();
+  mb_ns             = mb_clock.domain(1000000000UL);
+  timer_slack_ticks = mb_ns.from.apply(timer_slack * 1000ULL);
+
   // Allocating RAM.
 
   ram = reinterpret_cast<char *>(mmap(nullptr, ram_size, PROT_READ | PROT_WRITE,
@@ -569,15 +826,16 @@ int main(int argc, char **argv)
     perror("mmap");
     return EXIT_FAILURE;
   }
-
-  // Creating timer. I hate C++: No useful initializers...
-  struct sigevent ev;
-  ev.sigev_notify            = SIGEV_THREAD;
-  ev.sigev_notify_attributes = NULL;
-  ev.sigev_notify_function   = timeout_handler_fn;
-
-  if (0 != timer_create(CLOCK_MONOTONIC, &ev, &timer_id)) {
-    perror("timer_create");
+  ram_mapped = ram_size;
+
+  // Creating the timer and the other event sources.
+  if (0 > (timer_fd      = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) or
+      0 > (disk_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) or
+      0 > (epoll_fd      = epoll_create1(EPOLL_CLOEXEC)) or
+      not add_event_fd(timer_fd) or
+      not add_event_fd(disk_event_fd) or
+      (tap_fd and not add_event_fd(tap_fd))) {
+    perror("timer and event setup");
     return EXIT_FAILURE;
   }
 
@@ -629,14 +887,22 @@ int main(int argc, char **argv)
   MessageLegacy msg2(MessageLegacy::RESET, 0);
   mb.bus_legacy.send_fifo(msg2);
 
-  pthread_t iothread;
-  if (tap_fd) {
-    Logging::printf("Starting background threads.\n");
-    if (0 != pthread_create(&iothread, NULL, network_io_thread_fn, NULL)) {
+  Logging::printf("Starting background threads.\n");
+  atexit(print_timer_latency);
+  pthread_t eventthread;
+  if (0 != pthread_create(&eventthread, NULL, event_thread_fn, NULL)) {
+    perror("pthread_create");
+    return EXIT_FAILURE;
+  }
+  pthread_setname_np(eventthread, "events");
+
+  for (unsigned i = 0; !disks.empty() and i < disk_threads; i++) {
+    pthread_t diskthread;
+    if (0 != pthread_create(&diskthread, NULL, disk_io_thread_fn, NULL)) {
       perror("pthread_create");
       return EXIT_FAILURE;
     }
-    pthread_setname_np(iothread, "io");
+    pthread_setname_np(diskthread, "disk");
   }
 
   Logging::printf("Virtual CPUs starting.\n");
@@ -647,12 +913,6 @@ int main(int argc, char **argv)
     if (0 != pthread_join(i.tid, nullptr))
       perror("pthread_join");
 
-  // Force IO thread to exit.
-  if (tap_fd) {
-    close(tap_fd);
-    pthread_join(iothread, nullptr);
-  }
-
   printf("Terminating.\n");
   return EXIT_SUCCESS;
 }
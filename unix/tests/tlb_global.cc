@@ -0,0 +1,127 @@
+/** @file
+ * Test that global TLB entries survive a CR3 write.
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "executor/cpustate.h"
+#include "nul/motherboard.h"
+#include "nul/vcpu.h"
+#include "../executor/instcache.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void Logging::panic(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  abort();
+}
+
+void Logging::printf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+}
+
+void Logging::vprintf(const char *format, va_list &ap) { vfprintf(stderr, format, ap); }
+
+/**
+ * The guest RAM of the test, 1MB identity mapped.
+ */
+static char ram[1 << 20] __attribute__((aligned(4096)));
+
+static bool ram_region(Device *, MessageMemRegion &msg)
+{
+  if (msg.page >= sizeof(ram) >> 12) return false;
+  msg.start_page = 0;
+  msg.count      = sizeof(ram) >> 12;
+  msg.ptr        = ram;
+  return true;
+}
+
+class TlbTest : public MemTlb
+{
+public:
+  CpuState cpu;
+
+  void set_pte(unsigned virt, unsigned value) { reinterpret_cast<unsigned *>(ram + 0x2000)[(virt >> 12) & 0x3ff] = value; }
+
+  /**
+   * Translate a data address the way an instruction would.
+   */
+  uintptr_t translate(uintptr_t virt)
+  {
+    uintptr_t phys;
+    if (init() || !virt_to_host(virt, TYPE_R, phys)) return ~0ul;
+    return phys;
+  }
+
+  void write_cr3(unsigned value) { cpu.cr3 = value; tlb_cr3_write(); }
+
+  TlbTest(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion, DBus<MessageHostOp> &hostop)
+    : MemTlb(mem, memregion, hostop), cpu()
+  {
+    _cpu = &cpu;
+  }
+};
+
+static unsigned failures;
+
+static void check(const char *what, uintptr_t value, uintptr_t expected)
+{
+  if (value == expected) return;
+  printf("FAIL %s: %lx, expected %lx\n", what, value, expected);
+  failures++;
+}
+
+
+int main()
+{
+  DBus<MessageMem>       mem;
+  DBus<MessageMemRegion> memregion;
+  DBus<MessageHostOp>    hostop;
+  memregion.add(0, ram_region);
+
+  // 32-bit paging with PGE: the pagedir at 0x1000 and a pagetable at 0x2000 for 4M-8M
+  TlbTest tlb(mem, memregion, hostop);
+  reinterpret_cast<unsigned *>(ram + 0x1000)[1] = 0x2000 | 7;
+  tlb.set_pte(0x400000, 0x10000 | 0x100 | 7);
+  tlb.set_pte(0x401000, 0x11000 | 7);
+  tlb.cpu.cr0 = 0x80000001;
+  tlb.cpu.cr4 = 0x80;
+  tlb.cpu.cr3 = 0x1000;
+
+  check("global",     tlb.translate(0x400000), 0x10000);
+  check("non-global", tlb.translate(0x401000), 0x11000);
+
+  // change the mappings without a flush, a CR3 write drops only the non-global one
+  tlb.set_pte(0x400000, 0x20000 | 0x100 | 7);
+  tlb.set_pte(0x401000, 0x21000 | 7);
+  tlb.write_cr3(0x1000);
+  check("global after cr3 write",     tlb.translate(0x400000), 0x10000);
+  check("non-global after cr3 write", tlb.translate(0x401000), 0x21000);
+
+  // switching off PGE flushes the global ones as well
+  tlb.cpu.cr4 = 0;
+  check("global after cr4 write", tlb.translate(0x400000), 0x20000);
+
+  if (failures) return EXIT_FAILURE;
+  printf("tlb_global: OK\n");
+  return EXIT_SUCCESS;
+}